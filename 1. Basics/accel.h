@@ -1,5 +1,7 @@
 #pragma once
 #include "precomp.h"
+#include "mesh.h"
+#include "accelcache.h"
 #include <windows.h> 
 
 
@@ -9,56 +11,67 @@ namespace Tmpl8 {
 	{
 	public:
 		Accel() = default;
-		Accel(const char * objFile, uint* objIdxTracker, const float scale = 1, float3 offset = float3(0))
+		Accel(const char * objFile, int objIdx = -1, const float scale = 1, float3 offset = float3(0))
+			: Accel(make_shared<Mesh>(objFile, objIdx, scale, offset)) {}
+		Accel(shared_ptr<Mesh> sharedMesh) : mesh(sharedMesh)
 		{
-			FILE* file = fopen(objFile, "r");
-			tri = new Tri[MAX_TRIS];
-			N = new float3[MAX_TRIS], P = new float3[MAX_TRIS];
-
-			int Ns = 0, Ps = 0, a, b, c, d, e, f, g, h, i;
-			if (!file) return; // file doesn't exist
-			while (!feof(file))
-			{
-				char line[512] = { 0 };
-				fgets(line, 511, file);
-				if (line == strstr(line, "vn "))
-					sscanf(line + 3, "%f %f %f", &N[Ns].x, &N[Ns].y, &N[Ns].z), Ns++;
-				else if (line[0] == 'v') {
-					sscanf(line + 2, "%f %f %f", &P[Ps].x, &P[Ps].y, &P[Ps].z);
-					P[Ps].x += offset.x, P[Ps].y += offset.y, P[Ps].z += offset.z, Ps++;
-				}
-				if (line[0] != 'f') continue; else
-					sscanf(line + 2, "%i/%i/%i %i/%i/%i %i/%i/%i",
-						&a, &b, &c, &d, &e, &f, &g, &h, &i);
-				tri[triCount].vertexIdx0 = a - 1, tri[triCount].normalIdx0 = c - 1;
-				tri[triCount].vertexIdx1 = d - 1, tri[triCount].normalIdx1 = f - 1;
-				tri[triCount].vertexIdx2 = g - 1, tri[triCount].normalIdx2 = i - 1;
-				tri[triCount++].objIdx = (*objIdxTracker);
-				(*objIdxTracker)++;
-			}
-
-			fclose(file);
-
-			nodes = new Node[triCount*2];
+			// cache the mesh arrays; traversal code indexes them directly
+			tri = mesh->tri, triNormals = mesh->triNormals, P = mesh->P, N = mesh->N;
+			objIdx = mesh->objIdx;
+			Pq = mesh->Pq, Nq = mesh->Nq, qMin = mesh->qMin, qScale = mesh->qScale;
+			triCount = mesh->triCount, vertexCount = mesh->vertexCount, normalCount = mesh->normalCount;
 			triIdx = new uint[triCount];
 		}
 		void Build();
 		void Subdivide(uint nodeIdx);
 		void Intersect(Ray& ray, uint nodeIdx, int* intersectionTests, int* traversalSteps);
 
+		// release node data and this structure's hold on the mesh; the object can't be traced afterwards
+		void Free()
+		{
+			delete[] triIdx, delete[] nodes;
+			mesh.reset();
+			tri = 0, triNormals = 0, triIdx = 0, nodes = 0, P = N = 0, Pq = 0, Nq = 0;
+			triCount = vertexCount = normalCount = 0, nodesUsed = 1;
+		}
+
+		// node array and triangle order; all the BVH and the kD-tree need
+		void Serialize(AccelArchive& ar)
+		{
+			ar.Check((uint)sizeof(Node)), ar.Check(triCount);
+			ar.Value(rootNodeIdx), ar.Value(nodesUsed);
+			ar.Array(nodes, nodesUsed);
+			ar.Array(triIdx, triCount);
+		}
+
 		float3 GetAlbedo() const
 		{
 			return float3(1);
 		}
 
-		float3 GetNormal(uint objIdx) const
+		// vertex normals interpolated with the barycentrics that IntersectTri recorded
+		float3 GetNormal(uint primIdx, float u, float v) const
 		{
-			for (int i = 0; i < MAX_TRIS; i++) {
-				if (tri[i].objIdx == objIdx) {
-					return (N[tri[i].normalIdx0] + N[tri[i].normalIdx1] + N[tri[i].normalIdx2]) * 0.3333f;
-				}
-			}
-			return float3(1);
+			const TriNormals& t = triNormals[primIdx];
+			return normalize(Normal(t.normalIdx0) * (1 - u - v) + Normal(t.normalIdx1) * u + Normal(t.normalIdx2) * v);
+		}
+
+		// vertex data access; decodes on the fly when the mesh is compressed
+		float3 Vertex(uint i) const
+		{
+#ifdef MESH_COMPRESSED
+			return Mesh::DecodePosition(Pq + i * 3, qMin, qScale);
+#else
+			return P[i];
+#endif
+		}
+		float3 Normal(uint i) const
+		{
+#ifdef MESH_COMPRESSED
+			return Mesh::DecodeNormal(Nq[i]);
+#else
+			return N[i];
+#endif
 		}
 
 		float IntersectAABB(Ray& ray, const float3 bmin, const float3 bmax) const
@@ -73,23 +86,46 @@ namespace Tmpl8 {
 			else return 1e30f;
 		}
 
-		void IntersectTri(Ray& ray, const Tri& tri) const
+		// entry and exit distance of the ray through a box, clipped to [0, ray.t]
+		bool IntersectInterval(Ray& ray, float3 bmin, float3 bmax, float& tEnter, float& tExit) const
 		{
-			const float3 edge1 = P[tri.vertexIdx1] - P[tri.vertexIdx0];
-			const float3 edge2 = P[tri.vertexIdx2] - P[tri.vertexIdx0];
+			float3 t1 = (bmin - ray.O) * ray.rD, t2 = (bmax - ray.O) * ray.rD;
+			float3 tNear = fminf(t1, t2), tFar = fmaxf(t1, t2);
+			tEnter = max(max(tNear.x, tNear.y), max(tNear.z, 0.0f));
+			tExit = min(min(tFar.x, tFar.y), min(tFar.z, ray.t));
+			return tEnter <= tExit;
+		}
+
+		void GetTriBounds(uint idx, float3& tmin, float3& tmax) const
+		{
+			const Tri& t = tri[idx];
+			tmin = fminf(fminf(Vertex(t.vertexIdx0), Vertex(t.vertexIdx1)), Vertex(t.vertexIdx2));
+			tmax = fmaxf(fmaxf(Vertex(t.vertexIdx0), Vertex(t.vertexIdx1)), Vertex(t.vertexIdx2));
+		}
+
+		void IntersectTri(Ray& ray, const uint idx) const
+		{
+			const Tri& tri = this->tri[idx];
+			IntersectTri(ray, Vertex(tri.vertexIdx0), Vertex(tri.vertexIdx1), Vertex(tri.vertexIdx2), idx, objIdx);
+		}
+		// the same test on explicit vertices, for geometry that doesn't live in the mesh arrays
+		void IntersectTri(Ray& ray, const float3 p0, const float3 p1, const float3 p2, const uint idx, const int objIdx) const
+		{
+			const float3 edge1 = p1 - p0;
+			const float3 edge2 = p2 - p0;
 			const float3 h = cross(ray.D, edge2);
 			const float a = dot(edge1, h);
 			if (a > -0.0001f && a < 0.0001f) return; // ray parallel to triangle
 			const float f = 1 / a;
-			const float3 s = ray.O - P[tri.vertexIdx0];
+			const float3 s = ray.O - p0;
 			const float u = f * dot(s, h);
 			if (u < 0 || u > 1) return;
 			const float3 q = cross(s, edge1);
 			const float v = f * dot(ray.D, q);
 			if (v < 0 || u + v > 1) return;
 			const float t = f * dot(edge2, q);
-			if (t > 0.0001f && t < ray.t) 
-				ray.t = t; ray.objIdx = tri.objIdx;
+			if (t > 0.0001f && t < ray.t)
+				ray.t = t, ray.objIdx = objIdx, ray.primIdx = idx, ray.u = u, ray.v = v;
 		}
 		float EvaluateSAH(Node& node, int axis, float pos)
 		{
@@ -99,30 +135,45 @@ namespace Tmpl8 {
 			for (uint i = 0; i < node.triCount; i++)
 			{
 				Tri& triangle = tri[triIdx[node.leftFirst + i]];
-				if (triangle.centroid[axis] < pos)
+				if (centroid[triIdx[node.leftFirst + i]][axis] < pos)
 				{
 					leftCount++;
-					leftBox.Grow(P[triangle.vertexIdx0]);
-					leftBox.Grow(P[triangle.vertexIdx1]);
-					leftBox.Grow(P[triangle.vertexIdx2]);
+					leftBox.Grow(Vertex(triangle.vertexIdx0));
+					leftBox.Grow(Vertex(triangle.vertexIdx1));
+					leftBox.Grow(Vertex(triangle.vertexIdx2));
 				}
 				else
 				{
 					rightCount++;
-					rightBox.Grow(P[triangle.vertexIdx0]);
-					rightBox.Grow(P[triangle.vertexIdx1]);
-					rightBox.Grow(P[triangle.vertexIdx2]);
+					rightBox.Grow(Vertex(triangle.vertexIdx0));
+					rightBox.Grow(Vertex(triangle.vertexIdx1));
+					rightBox.Grow(Vertex(triangle.vertexIdx2));
 				}
 			}
 			float cost = leftCount * leftBox.Area() + rightCount * rightBox.Area();
 			return cost > 0 ? cost : 1e30f;
 		}
 
-		Tri* tri;
+		// triangle centroids for the split decisions of a build; released by the builder when done
+		void ComputeCentroids()
+		{
+			centroid.resize(triCount);
+			for (uint i = 0; i < triCount; i++)
+				centroid[i] = (Vertex(tri[i].vertexIdx0) + Vertex(tri[i].vertexIdx1) + Vertex(tri[i].vertexIdx2)) * 0.3333f;
+		}
+
+		Tri* tri = 0;				// read-only: the mesh is shared
+		TriNormals* triNormals = 0;	// shading only
+		int objIdx = -1;			// of the mesh: one scene object, hits tell triangles apart by primIdx
 		uint* triIdx = 0;
 		Node* nodes = 0;
 		int rootNodeIdx = 0, nodesUsed = 1;
-		uint triCount = 0;
+		uint triCount = 0, vertexCount = 0, normalCount = 0;
 		float3* P = 0, * N = 0;
+		ushort* Pq = 0;			// MESH_COMPRESSED: three 16-bit coordinates per vertex
+		uint* Nq = 0;			// MESH_COMPRESSED: octahedral normals
+		float3 qMin, qScale;
+		shared_ptr<Mesh> mesh;		// owns tri, P and N; shared with the other structures over this mesh
+		vector<float3> centroid;	// build only
 	};
 }
\ No newline at end of file
@@ -0,0 +1,152 @@
+#pragma once
+#include "precomp.h"
+#include "mesh.h"
+#include "mappedfile.h"
+
+#define ACCEL_CACHE_VERSION	1
+#define ACCEL_CACHE					// built structures are stored as <asset>.<mesh hash>.<type>.accel and loaded instead of rebuilt
+
+namespace Tmpl8 {
+
+// -----------------------------------------------------------
+// Serialization of built acceleration structures. Each
+// structure describes itself once, in Serialize(AccelArchive&);
+// the same code writes a cache file and reads it back.
+// Arrays are 64-byte aligned in the file. On load they are
+// copied out of the mapping into new[] arrays, so Free() and
+// rebuilding work exactly as after a regular build.
+// -----------------------------------------------------------
+class AccelArchive
+{
+public:
+	AccelArchive() : writing(true) {}
+	AccelArchive(const char* src, size_t srcSize) : writing(false), data(src), size(srcSize) {}
+
+	// plain values: counts, bounds, grid resolutions
+	template <class T> void Value(T& v)
+	{
+		if (writing) Append(&v, sizeof(T));
+		else Read(&v, sizeof(T));
+	}
+	// build parameters: stored on write, compared on read; a mismatch fails the load
+	template <class T> void Check(T v)
+	{
+		T stored = v;
+		Value(stored);
+		if (memcmp(&stored, &v, sizeof(T))) ok = false;
+	}
+	// count elements; on read, replaces the array with a new[] copy of the stored one
+	template <class T> void Array(T*& a, uint count)
+	{
+		Align();
+		if (writing) { if (count) Append(a, count * sizeof(T)); return; }
+		if (!ok || pos + (size_t)count * sizeof(T) > size) { ok = false; return; }
+		delete[] a;
+		a = new T[max(count, 1u)];
+		if (count) memcpy(a, data + pos, count * sizeof(T));
+		pos += count * sizeof(T);
+	}
+
+	void Append(const void* src, size_t bytes)
+	{
+		buffer.insert(buffer.end(), (const char*)src, (const char*)src + bytes);
+	}
+	void Read(void* dst, size_t bytes)
+	{
+		if (!ok || pos + bytes > size) { ok = false; return; }
+		memcpy(dst, data + pos, bytes);
+		pos += bytes;
+	}
+	void Align()
+	{
+		if (writing) buffer.resize((buffer.size() + 63) & ~(size_t)63, 0);
+		else pos = (pos + 63) & ~(size_t)63;
+	}
+
+	bool writing, ok = true;
+	vector<char> buffer;			// writing
+	const char* data = 0;			// reading
+	size_t size = 0, pos = 0;
+};
+
+// cache file: this header, then the archive, starting on a 64-byte boundary
+struct AccelCacheHeader
+{
+	char magic[4];					// "ACCL"
+	uint version;					// ACCEL_CACHE_VERSION
+	char type[8];					// structure tag, e.g. "bvh"
+	uint64_t meshHash;				// Mesh::Hash() of the geometry it was built over
+	uint64_t size;					// archive bytes
+	char pad[32];
+};
+
+// -----------------------------------------------------------
+// Load / store one structure. Load fails, and the caller
+// rebuilds, when the file is missing, was written by another
+// version, or was built over different geometry or with
+// different build parameters.
+// -----------------------------------------------------------
+class AccelCache
+{
+public:
+	// the geometry is part of the name: an asset placed with another scale or offset
+	// gets its own file instead of invalidating the first one
+	static string FileName(const string& asset, uint64_t meshHash, const char* type)
+	{
+		char hash[17];
+		snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)meshHash);
+		return asset + "." + hash + "." + type + ".accel";
+	}
+
+	// the header of a mapped cache file matches the version, the structure and the geometry
+	static bool Check(const MappedFile& mapping, const char* type, uint64_t meshHash, const string& file)
+	{
+		const AccelCacheHeader& h = *(const AccelCacheHeader*)mapping.data;
+		if (mapping.size < sizeof(AccelCacheHeader) || memcmp(h.magic, "ACCL", 4) || h.version != ACCEL_CACHE_VERSION ||
+			strncmp(h.type, type, sizeof(h.type)) || sizeof(AccelCacheHeader) + h.size > mapping.size) return false;
+		if (h.meshHash != meshHash)
+		{
+			printf("Cache: %s was built over different geometry, rebuilding\n", file.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	template <class T> static bool Load(T& accel, const string& asset, const char* type)
+	{
+		Timer t;
+		const string file = FileName(asset, accel.mesh->Hash(), type);
+		MappedFile mapping;
+		if (!mapping.Open(file.c_str())) return false;
+		if (!Check(mapping, type, accel.mesh->Hash(), file)) return false;
+		const AccelCacheHeader& h = *(const AccelCacheHeader*)mapping.data;
+		AccelArchive ar(mapping.data + sizeof(AccelCacheHeader), (size_t)h.size);
+		accel.Serialize(ar);
+		if (!ar.ok)
+		{
+			printf("Cache: %s is stale, rebuilding\n", file.c_str());
+			return false;
+		}
+		printf("Cache: %s loaded in %.1f ms\n", file.c_str(), t.elapsed() * 1000);
+		return true;
+	}
+
+	template <class T> static bool Save(T& accel, const string& asset, const char* type)
+	{
+		AccelArchive ar;
+		accel.Serialize(ar);
+		AccelCacheHeader h = {};
+		memcpy(h.magic, "ACCL", 4);
+		h.version = ACCEL_CACHE_VERSION;
+		strncpy(h.type, type, sizeof(h.type));
+		h.meshHash = accel.mesh->Hash();
+		h.size = ar.buffer.size();
+		FILE* f = fopen(FileName(asset, h.meshHash, type).c_str(), "wb");
+		if (!f) return false;
+		bool ok = fwrite(&h, sizeof(h), 1, f) == 1 && fwrite(ar.buffer.data(), 1, ar.buffer.size(), f) == ar.buffer.size();
+		fclose(f);
+		return ok;
+	}
+};
+
+}
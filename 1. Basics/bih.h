@@ -0,0 +1,175 @@
+#pragma once
+#include "accel.h"
+#include "tmplmath.h"
+
+#define BIH_MAX_DEPTH	48		// also bounds the traversal stack
+#define BIH_LEAF_SIZE	4		// nodes with this many triangles or fewer always become leaves
+
+namespace Tmpl8 {
+
+// bounding interval hierarchy node: two clip planes along one axis instead of
+// two full boxes. Children are stored in pairs; leaves store a triangle range.
+struct BIHNode
+{
+	float clip[2];					// interior: max of the left child, min of the right child
+	uint first;						// interior: left child (right child follows); leaf: first triangle
+	uint count : 30, axis : 2;		// axis 3 marks a leaf
+	bool isLeaf() { return axis == 3; }
+};
+
+class BIH : public Accel
+{
+public:
+	BIH() = default;
+	BIH(const char* objFile, int objIdx = -1, const float scale = 1, float3 offset = 0) : Accel(objFile, objIdx, scale, offset) {}
+	BIH(shared_ptr<Mesh> mesh) : Accel(mesh) {}
+
+	void BIH::Build()
+	{
+		Timer t;
+		// triangle bounds are only needed during the build
+		triMin.resize(triCount), triMax.resize(triCount);
+		aabbMin = float3(1e30f);
+		aabbMax = float3(-1e30f);
+		for (uint i = 0; i < triCount; i++)
+		{
+			GetTriBounds(i, triMin[i], triMax[i]);
+			aabbMin = fminf(aabbMin, triMin[i]);
+			aabbMax = fmaxf(aabbMax, triMax[i]);
+			triIdx[i] = i;
+		}
+		vector<BIHNode> buildNodes(1);
+		maxDepth = 0;
+		Subdivide(rootNodeIdx, 0, triCount, aabbMin, aabbMax, 0, buildNodes);
+		vector<float3>().swap(triMin);
+		vector<float3>().swap(triMax);
+		delete[] bihNodes;
+		nodesUsed = (int)buildNodes.size();
+		bihNodes = new BIHNode[nodesUsed];
+		memcpy(bihNodes, buildNodes.data(), nodesUsed * sizeof(BIHNode));
+		printf("BIH: %i nodes, depth %u, %.1f KB, built in %.1f ms\n", nodesUsed, maxDepth,
+			(nodesUsed * sizeof(BIHNode) + triCount * sizeof(uint)) / 1024.0f, t.elapsed() * 1000);
+	}
+
+	void BIH::Subdivide(uint nodeIdx, uint first, uint count, float3 gridMin, float3 gridMax, uint depth, vector<BIHNode>& buildNodes)
+	{
+		maxDepth = max(maxDepth, depth);
+		// the split plane halves the node's share of the global grid, not its
+		// bounds; when one side comes out empty the grid shrinks and we retry.
+		for (int attempt = 0; count > BIH_LEAF_SIZE && depth < BIH_MAX_DEPTH && attempt < 32; attempt++)
+		{
+			float3 e = gridMax - gridMin;
+			int axis = 0;
+			if (e.y > e.x) axis = 1;
+			if (e.z > e[axis]) axis = 2;
+			float splitPos = (gridMin[axis] + gridMax[axis]) * 0.5f;
+			// in-place partition on the triangle box centers
+			float leftMax = -1e30f, rightMin = 1e30f;
+			int i = first, j = first + count - 1;
+			while (i <= j)
+			{
+				uint idx = triIdx[i];
+				if (triMin[idx][axis] + triMax[idx][axis] < 2 * splitPos)
+					leftMax = max(leftMax, triMax[idx][axis]), i++;
+				else
+					rightMin = min(rightMin, triMin[idx][axis]), swap(triIdx[i], triIdx[j--]);
+			}
+			uint leftCount = i - first;
+			if (leftCount == 0) { gridMin[axis] = splitPos; continue; }
+			if (leftCount == count) { gridMax[axis] = splitPos; continue; }
+			// create child nodes
+			uint leftChildIdx = (uint)buildNodes.size();
+			buildNodes.resize(leftChildIdx + 2);
+			BIHNode& node = buildNodes[nodeIdx];
+			node.clip[0] = leftMax, node.clip[1] = rightMin;
+			node.first = leftChildIdx;
+			node.count = 0, node.axis = axis;
+			// recurse
+			float3 leftGridMax = gridMax, rightGridMin = gridMin;
+			leftGridMax[axis] = rightGridMin[axis] = splitPos;
+			Subdivide(leftChildIdx, first, leftCount, gridMin, leftGridMax, depth + 1, buildNodes);
+			Subdivide(leftChildIdx + 1, first + leftCount, count - leftCount, rightGridMin, gridMax, depth + 1, buildNodes);
+			return;
+		}
+		// make leaf
+		BIHNode& leaf = buildNodes[nodeIdx];
+		leaf.first = first;
+		leaf.count = count, leaf.axis = 3;
+	}
+
+	void BIH::Intersect(Ray& ray, uint nodeIdx, int* intersectionTests, int* traversalSteps)
+	{
+		struct StackEntry { BIHNode* node; float tEnter, tExit; } stack[BIH_MAX_DEPTH + 2];
+		BIHNode* node = &bihNodes[nodeIdx];
+		uint stackPtr = 0;
+		float tEnter, tExit;
+
+		(*intersectionTests)++;
+		(*traversalSteps)++;
+		if (!IntersectInterval(ray, aabbMin, aabbMax, tEnter, tExit)) return;
+		while (1)
+		{
+			if (node->isLeaf())
+			{
+				for (uint i = 0; i < node->count; i++)
+				{
+					IntersectTri(ray, triIdx[node->first + i]);
+					(*intersectionTests)++;
+				}
+			}
+			else
+			{
+				// clip the ray interval against both planes
+				const int a = node->axis;
+				BIHNode* left = &bihNodes[node->first], * right = left + 1;
+				(*intersectionTests)++;
+				if (ray.D[a] == 0)
+				{
+					if (ray.O[a] >= node->clip[1]) stack[stackPtr++] = { right, tEnter, tExit };
+					if (ray.O[a] <= node->clip[0]) stack[stackPtr++] = { left, tEnter, tExit };
+				}
+				else
+				{
+					float tLeft = (node->clip[0] - ray.O[a]) * ray.rD[a];
+					float tRight = (node->clip[1] - ray.O[a]) * ray.rD[a];
+					BIHNode* nearChild = left, * farChild = right;
+					if (ray.D[a] < 0) swap(nearChild, farChild), swap(tLeft, tRight);
+					// tLeft now bounds the near child, tRight the far child; push far first
+					if (tRight <= tExit) stack[stackPtr++] = { farChild, max(tEnter, tRight), tExit };
+					if (tLeft >= tEnter) stack[stackPtr++] = { nearChild, tEnter, min(tExit, tLeft) };
+				}
+			}
+			// skip children that start beyond the nearest hit found so far
+			do
+			{
+				if (stackPtr == 0) return;
+				stackPtr--;
+			} while (stack[stackPtr].tEnter > ray.t);
+			node = stack[stackPtr].node;
+			tEnter = stack[stackPtr].tEnter, tExit = stack[stackPtr].tExit;
+			(*traversalSteps)++;
+		}
+	}
+
+	void BIH::Serialize(AccelArchive& ar)
+	{
+		ar.Check(BIH_MAX_DEPTH), ar.Check(BIH_LEAF_SIZE), ar.Check((uint)sizeof(BIHNode)), ar.Check(triCount);
+		ar.Value(aabbMin), ar.Value(aabbMax), ar.Value(maxDepth), ar.Value(nodesUsed);
+		ar.Array(bihNodes, nodesUsed);
+		ar.Array(triIdx, triCount);
+	}
+
+	void BIH::Free()
+	{
+		delete[] bihNodes;
+		bihNodes = 0;
+		Accel::Free();
+	}
+
+	BIHNode* bihNodes = 0;
+	float3 aabbMin, aabbMax;
+	uint maxDepth = 0;
+	vector<float3> triMin, triMax;	// build only
+};
+
+}
@@ -8,21 +8,25 @@ class BVH : public Accel
 {
 public:
 	BVH() = default;
-	BVH(const char* objFile, uint* objIdxTracker, const float scale = 1, float3 offset = 0) : Accel(objFile, objIdxTracker, scale, offset) {}
+	BVH(const char* objFile, int objIdx = -1, const float scale = 1, float3 offset = 0) : Accel(objFile, objIdx, scale, offset) {}
+	BVH(shared_ptr<Mesh> mesh) : Accel(mesh) {}
 	void BVH::Build() 
 	{
+		// a binary BVH over N triangles never needs more than 2N - 1 nodes
+		delete[] nodes;
+		nodes = new Node[triCount * 2], nodesUsed = 1;
 		for (uint i = 0; i < triCount; i++) {
 			// populate triangle index array
 			triIdx[i] = i;
-			// calculate triangle centroids for partitioning
-			tri[i].centroid = (P[tri[i].vertexIdx0] + P[tri[i].vertexIdx1] + P[tri[i].vertexIdx2]) * 0.3333f;
 		}
 		// assign all triangles to root node
 		Node& root = nodes[rootNodeIdx];
 		root.leftFirst = 0, root.triCount = triCount;
 		UpdateNodeBounds(rootNodeIdx);
 		// subdivide recursively
+		ComputeCentroids();
 		Subdivide(rootNodeIdx);
+		vector<float3>().swap(centroid);
 	}
 	void BVH::Intersect(Ray& ray, uint nodeIdx, int* intersectionTests, int* traversalSteps)
 	{
@@ -38,7 +42,7 @@ public:
 			{
 				for (uint i = 0; i < node->triCount; i++)
 				{
-					IntersectTri(ray, tri[triIdx[node->leftFirst + i]]);
+					IntersectTri(ray, triIdx[node->leftFirst + i]);
 					(*intersectionTests)++;
 				}
 				if (stackPtr == 0) break; else node = stack[--stackPtr];
@@ -76,8 +80,7 @@ public:
 		float bestPos = 0, bestCost = 1e30f;
 		for (int axis = 0; axis < 3; axis++) for (uint i = 0; i < node.triCount; i++)
 		{
-			Tri& triangle = tri[triIdx[node.leftFirst + i]];
-			float candidatePos = triangle.centroid[axis];
+			float candidatePos = centroid[triIdx[node.leftFirst + i]][axis];
 			float cost = EvaluateSAH(node, axis, candidatePos);
 			if (cost < bestCost)
 				bestPos = candidatePos, bestAxis = axis, bestCost = cost;
@@ -93,7 +96,7 @@ public:
 		int j = i + node.triCount - 1;
 		while (i <= j)
 		{
-			if (tri[triIdx[i]].centroid[axis] < splitPos)
+			if (centroid[triIdx[i]][axis] < splitPos)
 				i++;
 			else
 				swap(triIdx[i], triIdx[j--]);
@@ -127,12 +130,12 @@ public:
 		{
 			uint leafTriIdx = triIdx[first + i];
 			Tri& leafTri = tri[leafTriIdx];
-			node.aabbMin = fminf(node.aabbMin, P[leafTri.vertexIdx0]);
-			node.aabbMin = fminf(node.aabbMin, P[leafTri.vertexIdx1]);
-			node.aabbMin = fminf(node.aabbMin, P[leafTri.vertexIdx2]);
-			node.aabbMax = fmaxf(node.aabbMax, P[leafTri.vertexIdx0]);
-			node.aabbMax = fmaxf(node.aabbMax, P[leafTri.vertexIdx1]);
-			node.aabbMax = fmaxf(node.aabbMax, P[leafTri.vertexIdx2]);
+			node.aabbMin = fminf(node.aabbMin, Vertex(leafTri.vertexIdx0));
+			node.aabbMin = fminf(node.aabbMin, Vertex(leafTri.vertexIdx1));
+			node.aabbMin = fminf(node.aabbMin, Vertex(leafTri.vertexIdx2));
+			node.aabbMax = fmaxf(node.aabbMax, Vertex(leafTri.vertexIdx0));
+			node.aabbMax = fmaxf(node.aabbMax, Vertex(leafTri.vertexIdx1));
+			node.aabbMax = fmaxf(node.aabbMax, Vertex(leafTri.vertexIdx2));
 		}
 	}
 
@@ -0,0 +1,149 @@
+#pragma once
+#include "accel.h"
+#include "tmplmath.h"
+
+#define GRID_DENSITY	2		// target number of cells per triangle
+#define GRID_MAX_RES	256		// per-axis resolution limit
+
+namespace Tmpl8 {
+
+class Grid : public Accel
+{
+public:
+	Grid() = default;
+	Grid(const char* objFile, int objIdx = -1, const float scale = 1, float3 offset = 0) : Accel(objFile, objIdx, scale, offset) {}
+	Grid(shared_ptr<Mesh> mesh) : Accel(mesh) {}
+
+	void Grid::Build()
+	{
+		Timer t;
+		// get bounds
+		aabbMin = float3(1e30f);
+		aabbMax = float3(-1e30f);
+		for (uint i = 0; i < triCount; i++)
+		{
+			float3 tmin, tmax;
+			GetTriBounds(i, tmin, tmax);
+			aabbMin = fminf(aabbMin, tmin);
+			aabbMax = fmaxf(aabbMax, tmax);
+		}
+		// pad flat meshes, so that every axis has a non-zero extent
+		float3 e = aabbMax - aabbMin;
+		float pad = max(max(e.x, e.y), max(e.z, 1e-6f)) * 0.001f;
+		aabbMin -= pad, aabbMax += pad, e = aabbMax - aabbMin;
+		// resolution: cube-root heuristic for roughly GRID_DENSITY cubic cells per triangle
+		float cellSize = cbrtf(e.x * e.y * e.z / (GRID_DENSITY * max(triCount, 1u)));
+		for (int a = 0; a < 3; a++)
+		{
+			res[a] = clamp((int)(e[a] / cellSize), 1, GRID_MAX_RES);
+			invCellSize[a] = res[a] / e[a];
+		}
+		cellCount = res[0] * res[1] * res[2];
+		// first pass: count the references of each cell
+		delete[] cellStart;
+		cellStart = new uint[cellCount + 1];
+		memset(cellStart, 0, (cellCount + 1) * sizeof(uint));
+		for (uint i = 0; i < triCount; i++)
+		{
+			int c0[3], c1[3];
+			GetCellRange(i, c0, c1);
+			for (int z = c0[2]; z <= c1[2]; z++) for (int y = c0[1]; y <= c1[1]; y++) for (int x = c0[0]; x <= c1[0]; x++)
+				cellStart[x + (y + z * res[1]) * res[0] + 1]++;
+		}
+		// prefix sum turns counts into offsets: cell c owns cellTris[cellStart[c] .. cellStart[c + 1])
+		for (uint c = 0; c < cellCount; c++) cellStart[c + 1] += cellStart[c];
+		refCount = cellStart[cellCount];
+		// second pass: scatter the triangle indices
+		delete[] cellTris;
+		cellTris = new uint[max(refCount, 1u)];
+		uint* cursor = new uint[cellCount];
+		memcpy(cursor, cellStart, cellCount * sizeof(uint));
+		for (uint i = 0; i < triCount; i++)
+		{
+			int c0[3], c1[3];
+			GetCellRange(i, c0, c1);
+			for (int z = c0[2]; z <= c1[2]; z++) for (int y = c0[1]; y <= c1[1]; y++) for (int x = c0[0]; x <= c1[0]; x++)
+				cellTris[cursor[x + (y + z * res[1]) * res[0]]++] = i;
+		}
+		delete[] cursor;
+		printf("Grid: %ix%ix%i cells, %u triangle refs (%.2f per tri), %.1f KB, built in %.1f ms\n",
+			res[0], res[1], res[2], refCount, (float)refCount / max(triCount, 1u),
+			((cellCount + 1) * sizeof(uint) + refCount * sizeof(uint)) / 1024.0f, t.elapsed() * 1000);
+	}
+
+	void Grid::Intersect(Ray& ray, uint nodeIdx, int* intersectionTests, int* traversalSteps)
+	{
+		float tEnter, tExit;
+		(*intersectionTests)++;
+		if (!IntersectInterval(ray, aabbMin, aabbMax, tEnter, tExit)) return;
+		// 3D-DDA setup: start in the cell that contains the entry point
+		float3 entry = ray.O + tEnter * ray.D;
+		int cell[3], step[3];
+		float tNext[3], tDelta[3];
+		for (int a = 0; a < 3; a++)
+		{
+			cell[a] = clamp((int)((entry[a] - aabbMin[a]) * invCellSize[a]), 0, res[a] - 1);
+			if (ray.D[a] == 0)
+			{
+				step[a] = 0, tNext[a] = tDelta[a] = 1e30f;
+				continue;
+			}
+			step[a] = ray.D[a] > 0 ? 1 : -1;
+			tDelta[a] = fabs(ray.rD[a]) / invCellSize[a];
+			float boundary = aabbMin[a] + (cell[a] + (ray.D[a] > 0)) / invCellSize[a];
+			tNext[a] = (boundary - ray.O[a]) * ray.rD[a];
+		}
+		while (1)
+		{
+			(*traversalSteps)++;
+			uint c = cell[0] + (cell[1] + cell[2] * res[1]) * res[0];
+			for (uint i = cellStart[c]; i < cellStart[c + 1]; i++)
+			{
+				IntersectTri(ray, cellTris[i]);
+				(*intersectionTests)++;
+			}
+			// step to the neighbour across the nearest cell boundary
+			int a = tNext[0] < tNext[1] ? (tNext[0] < tNext[2] ? 0 : 2) : (tNext[1] < tNext[2] ? 1 : 2);
+			// early exit: a hit before the boundary lies inside this cell, so it is the nearest
+			if (ray.t <= tNext[a] || tNext[a] > tExit) return;
+			cell[a] += step[a];
+			if (cell[a] < 0 || cell[a] >= res[a]) return;
+			tNext[a] += tDelta[a];
+		}
+	}
+
+	void Grid::GetCellRange(uint idx, int(&c0)[3], int(&c1)[3])
+	{
+		float3 tmin, tmax;
+		GetTriBounds(idx, tmin, tmax);
+		for (int a = 0; a < 3; a++)
+		{
+			c0[a] = clamp((int)((tmin[a] - aabbMin[a]) * invCellSize[a]), 0, res[a] - 1);
+			c1[a] = clamp((int)((tmax[a] - aabbMin[a]) * invCellSize[a]), 0, res[a] - 1);
+		}
+	}
+
+	void Grid::Serialize(AccelArchive& ar)
+	{
+		ar.Check(GRID_DENSITY), ar.Check(GRID_MAX_RES);
+		ar.Value(res), ar.Value(aabbMin), ar.Value(aabbMax), ar.Value(invCellSize);
+		ar.Value(cellCount), ar.Value(refCount);
+		ar.Array(cellStart, cellCount + 1);
+		ar.Array(cellTris, refCount);
+	}
+
+	void Grid::Free()
+	{
+		delete[] cellStart, delete[] cellTris;
+		cellStart = cellTris = 0;
+		Accel::Free();
+	}
+
+	uint* cellStart = 0;		// cellCount + 1 offsets into cellTris
+	uint* cellTris = 0;
+	uint cellCount = 0, refCount = 0;
+	int res[3] = { 1, 1, 1 };
+	float3 aabbMin, aabbMax, invCellSize;
+};
+
+}
@@ -0,0 +1,285 @@
+#pragma once
+#include "accel.h"
+#include "tmplmath.h"
+
+#define HGRID_TOP_DENSITY	0.125f	// target number of top-level cells per triangle
+#define HGRID_SUB_DENSITY	2		// target number of sub-grid cells per referenced triangle
+#define HGRID_REFINE		16		// top-level cells with more references get a sub-grid
+#define HGRID_MAX_RES		64		// per-axis resolution limit, top level
+#define HGRID_MAX_SUB_RES	16		// per-axis resolution limit, sub-grids
+
+namespace Tmpl8 {
+
+// sub-grid of one refined top-level cell; its cell offsets live in HGrid::subStart
+struct SubGrid
+{
+	float3 aabbMin, invCellSize;
+	int res[3];
+	uint cellBase;		// first of the res[0] * res[1] * res[2] + 1 offsets in subStart
+};
+
+// -----------------------------------------------------------
+// Two-level grid
+// A coarse uniform grid over the mesh; top-level cells that hold
+// many triangles are refined into their own uniform sub-grid, so
+// dense areas get small cells without paying for them everywhere.
+// -----------------------------------------------------------
+class HGrid : public Accel
+{
+public:
+	HGrid() = default;
+	HGrid(const char* objFile, int objIdx = -1, const float scale = 1, float3 offset = 0) : Accel(objFile, objIdx, scale, offset) {}
+	HGrid(shared_ptr<Mesh> mesh) : Accel(mesh) {}
+
+	void HGrid::Build()
+	{
+		Timer t;
+		// get bounds
+		aabbMin = float3(1e30f);
+		aabbMax = float3(-1e30f);
+		for (uint i = 0; i < triCount; i++)
+		{
+			float3 tmin, tmax;
+			GetTriBounds(i, tmin, tmax);
+			aabbMin = fminf(aabbMin, tmin);
+			aabbMax = fmaxf(aabbMax, tmax);
+		}
+		// pad flat meshes, so that every axis has a non-zero extent
+		float3 e = aabbMax - aabbMin;
+		float pad = max(max(e.x, e.y), max(e.z, 1e-6f)) * 0.001f;
+		aabbMin -= pad, aabbMax += pad;
+		SetResolution(aabbMin, aabbMax, HGRID_TOP_DENSITY * triCount, HGRID_MAX_RES, res, invCellSize);
+		cellCount = res[0] * res[1] * res[2];
+		// top level: count, prefix sum, scatter
+		vector<uint> topStart(cellCount + 1, 0), topTris;
+		for (uint i = 0; i < triCount; i++)
+		{
+			int c0[3], c1[3];
+			GetCellRange(i, aabbMin, invCellSize, res, c0, c1);
+			for (int z = c0[2]; z <= c1[2]; z++) for (int y = c0[1]; y <= c1[1]; y++) for (int x = c0[0]; x <= c1[0]; x++)
+				topStart[x + (y + z * res[1]) * res[0] + 1]++;
+		}
+		for (uint c = 0; c < cellCount; c++) topStart[c + 1] += topStart[c];
+		topTris.resize(topStart[cellCount]);
+		vector<uint> cursor(topStart.begin(), topStart.end() - 1);
+		for (uint i = 0; i < triCount; i++)
+		{
+			int c0[3], c1[3];
+			GetCellRange(i, aabbMin, invCellSize, res, c0, c1);
+			for (int z = c0[2]; z <= c1[2]; z++) for (int y = c0[1]; y <= c1[1]; y++) for (int x = c0[0]; x <= c1[0]; x++)
+				topTris[cursor[x + (y + z * res[1]) * res[0]]++] = i;
+		}
+		// select the dense cells
+		vector<uint> refined;
+		delete[] subGridIdx;
+		subGridIdx = new int[cellCount];
+		for (uint c = 0; c < cellCount; c++)
+		{
+			if (topStart[c + 1] - topStart[c] <= HGRID_REFINE) { subGridIdx[c] = -1; continue; }
+			subGridIdx[c] = (int)refined.size();
+			refined.push_back(c);
+		}
+		// refine them in parallel; every sub-grid is built into its own lists
+		const int subCount = (int)refined.size();
+		vector<SubGrid> grids(subCount);
+		vector<vector<uint>> localStart(subCount), localTris(subCount);
+#pragma omp parallel for schedule(dynamic)
+		for (int k = 0; k < subCount; k++)
+		{
+			const uint c = refined[k];
+			const uint first = topStart[c], count = topStart[c + 1] - first;
+			SubGrid& g = grids[k];
+			const int cx = c % res[0], cy = (c / res[0]) % res[1], cz = c / (res[0] * res[1]);
+			float3 cmin = aabbMin + float3((float)cx, (float)cy, (float)cz) / invCellSize;
+			float3 cmax = cmin + float3(1) / invCellSize;
+			SetResolution(cmin, cmax, (float)(HGRID_SUB_DENSITY * count), HGRID_MAX_SUB_RES, g.res, g.invCellSize);
+			g.aabbMin = cmin;
+			const uint subCells = g.res[0] * g.res[1] * g.res[2];
+			vector<uint>& start = localStart[k];
+			vector<uint>& tris = localTris[k];
+			start.assign(subCells + 1, 0);
+			for (uint i = first; i < first + count; i++)
+			{
+				int c0[3], c1[3];
+				GetCellRange(topTris[i], g.aabbMin, g.invCellSize, g.res, c0, c1);
+				for (int z = c0[2]; z <= c1[2]; z++) for (int y = c0[1]; y <= c1[1]; y++) for (int x = c0[0]; x <= c1[0]; x++)
+					start[x + (y + z * g.res[1]) * g.res[0] + 1]++;
+			}
+			for (uint s = 0; s < subCells; s++) start[s + 1] += start[s];
+			tris.resize(start[subCells]);
+			vector<uint> subCursor(start.begin(), start.end() - 1);
+			for (uint i = first; i < first + count; i++)
+			{
+				int c0[3], c1[3];
+				GetCellRange(topTris[i], g.aabbMin, g.invCellSize, g.res, c0, c1);
+				for (int z = c0[2]; z <= c1[2]; z++) for (int y = c0[1]; y <= c1[1]; y++) for (int x = c0[0]; x <= c1[0]; x++)
+					tris[subCursor[x + (y + z * g.res[1]) * g.res[0]]++] = topTris[i];
+			}
+		}
+		// concatenate the sub-grids into flat arrays
+		uint startCount = 0, subRefs = 0;
+		for (int k = 0; k < subCount; k++) startCount += (uint)localStart[k].size(), subRefs += (uint)localTris[k].size();
+		delete[] subGrids;
+		delete[] subStart;
+		delete[] subTris;
+		subGrids = new SubGrid[max(subCount, 1)];
+		subStart = new uint[max(startCount, 1u)];
+		subTris = new uint[max(subRefs, 1u)];
+		for (int k = 0, startBase = 0, trisBase = 0; k < subCount; k++)
+		{
+			subGrids[k] = grids[k];
+			subGrids[k].cellBase = startBase;
+			for (uint s = 0; s < localStart[k].size(); s++) subStart[startBase + s] = trisBase + localStart[k][s];
+			if (!localTris[k].empty()) memcpy(subTris + trisBase, localTris[k].data(), localTris[k].size() * sizeof(uint));
+			startBase += (int)localStart[k].size(), trisBase += (int)localTris[k].size();
+		}
+		// unrefined cells keep their top-level references
+		delete[] cellStart;
+		delete[] cellTris;
+		cellStart = new uint[cellCount + 1];
+		cellTris = new uint[max((uint)topTris.size(), 1u)];
+		memcpy(cellStart, topStart.data(), (cellCount + 1) * sizeof(uint));
+		if (!topTris.empty()) memcpy(cellTris, topTris.data(), topTris.size() * sizeof(uint));
+		subGridCount = subCount, subStartCount = startCount, subRefCount = subRefs;
+		refCount = (uint)topTris.size() + subRefs;
+		printf("HGrid: %ix%ix%i cells, %i sub-grids, %u triangle refs, %.1f KB, built in %.1f ms\n",
+			res[0], res[1], res[2], subGridCount, refCount,
+			((cellCount + 1 + startCount + refCount) * sizeof(uint) + cellCount * sizeof(int) + subCount * sizeof(SubGrid)) / 1024.0f,
+			t.elapsed() * 1000);
+	}
+
+	void HGrid::Intersect(Ray& ray, uint nodeIdx, int* intersectionTests, int* traversalSteps)
+	{
+		float tEnter, tExit;
+		(*intersectionTests)++;
+		if (!IntersectInterval(ray, aabbMin, aabbMax, tEnter, tExit)) return;
+		int cell[3], step[3];
+		float tNext[3], tDelta[3];
+		SetupDDA(ray, aabbMin, invCellSize, res, tEnter, cell, step, tNext, tDelta);
+		float tCell = tEnter;
+		while (1)
+		{
+			(*traversalSteps)++;
+			uint c = cell[0] + (cell[1] + cell[2] * res[1]) * res[0];
+			int a = tNext[0] < tNext[1] ? (tNext[0] < tNext[2] ? 0 : 2) : (tNext[1] < tNext[2] ? 1 : 2);
+			if (subGridIdx[c] >= 0)
+			{
+				// dense cell: walk its sub-grid over the part of the ray inside this cell
+				IntersectSubGrid(ray, subGrids[subGridIdx[c]], tCell, min(tNext[a], tExit), intersectionTests, traversalSteps);
+			}
+			else for (uint i = cellStart[c]; i < cellStart[c + 1]; i++)
+			{
+				IntersectTri(ray, cellTris[i]);
+				(*intersectionTests)++;
+			}
+			// early exit: a hit before the boundary lies inside this cell, so it is the nearest
+			if (ray.t <= tNext[a] || tNext[a] > tExit) return;
+			cell[a] += step[a];
+			if (cell[a] < 0 || cell[a] >= res[a]) return;
+			tCell = tNext[a];
+			tNext[a] += tDelta[a];
+		}
+	}
+
+	void HGrid::IntersectSubGrid(Ray& ray, SubGrid& g, float tEnter, float tExit, int* intersectionTests, int* traversalSteps)
+	{
+		int cell[3], step[3];
+		float tNext[3], tDelta[3];
+		SetupDDA(ray, g.aabbMin, g.invCellSize, g.res, tEnter, cell, step, tNext, tDelta);
+		while (1)
+		{
+			(*traversalSteps)++;
+			uint c = g.cellBase + cell[0] + (cell[1] + cell[2] * g.res[1]) * g.res[0];
+			for (uint i = subStart[c]; i < subStart[c + 1]; i++)
+			{
+				IntersectTri(ray, subTris[i]);
+				(*intersectionTests)++;
+			}
+			int a = tNext[0] < tNext[1] ? (tNext[0] < tNext[2] ? 0 : 2) : (tNext[1] < tNext[2] ? 1 : 2);
+			if (ray.t <= tNext[a] || tNext[a] > tExit) return;
+			cell[a] += step[a];
+			if (cell[a] < 0 || cell[a] >= g.res[a]) return;
+			tNext[a] += tDelta[a];
+		}
+	}
+
+	// 3D-DDA setup: start in the cell that contains the point at distance tEnter
+	void HGrid::SetupDDA(Ray& ray, float3 bmin, float3 invSize, const int(&gridRes)[3], float tEnter,
+		int(&cell)[3], int(&step)[3], float(&tNext)[3], float(&tDelta)[3]) const
+	{
+		float3 entry = ray.O + tEnter * ray.D;
+		for (int a = 0; a < 3; a++)
+		{
+			cell[a] = clamp((int)((entry[a] - bmin[a]) * invSize[a]), 0, gridRes[a] - 1);
+			if (ray.D[a] == 0)
+			{
+				step[a] = 0, tNext[a] = tDelta[a] = 1e30f;
+				continue;
+			}
+			step[a] = ray.D[a] > 0 ? 1 : -1;
+			tDelta[a] = fabs(ray.rD[a]) / invSize[a];
+			float boundary = bmin[a] + (cell[a] + (ray.D[a] > 0)) / invSize[a];
+			tNext[a] = (boundary - ray.O[a]) * ray.rD[a];
+		}
+	}
+
+	// cube-root heuristic: roughly targetCells cubic cells inside the given box
+	void HGrid::SetResolution(float3 bmin, float3 bmax, float targetCells, int maxRes, int(&gridRes)[3], float3& invSize) const
+	{
+		float3 e = bmax - bmin;
+		float cellSize = cbrtf(e.x * e.y * e.z / max(targetCells, 1.0f));
+		for (int a = 0; a < 3; a++)
+		{
+			gridRes[a] = clamp((int)(e[a] / cellSize), 1, maxRes);
+			invSize[a] = gridRes[a] / e[a];
+		}
+	}
+
+	void HGrid::GetCellRange(uint idx, float3 bmin, float3 invSize, const int(&gridRes)[3], int(&c0)[3], int(&c1)[3]) const
+	{
+		float3 tmin, tmax;
+		GetTriBounds(idx, tmin, tmax);
+		for (int a = 0; a < 3; a++)
+		{
+			c0[a] = clamp((int)((tmin[a] - bmin[a]) * invSize[a]), 0, gridRes[a] - 1);
+			c1[a] = clamp((int)((tmax[a] - bmin[a]) * invSize[a]), 0, gridRes[a] - 1);
+		}
+	}
+
+	void HGrid::Serialize(AccelArchive& ar)
+	{
+		ar.Check(HGRID_TOP_DENSITY), ar.Check(HGRID_SUB_DENSITY), ar.Check(HGRID_REFINE), ar.Check(HGRID_MAX_RES), ar.Check(HGRID_MAX_SUB_RES);
+		ar.Check((uint)sizeof(SubGrid));
+		ar.Value(res), ar.Value(aabbMin), ar.Value(aabbMax), ar.Value(invCellSize);
+		ar.Value(cellCount), ar.Value(refCount), ar.Value(subGridCount), ar.Value(subStartCount), ar.Value(subRefCount);
+		ar.Array(cellStart, cellCount + 1);
+		ar.Array(cellTris, refCount - subRefCount);
+		ar.Array(subGridIdx, cellCount);
+		ar.Array(subGrids, (uint)subGridCount);
+		ar.Array(subStart, subStartCount);
+		ar.Array(subTris, subRefCount);
+	}
+
+	void HGrid::Free()
+	{
+		delete[] cellStart, delete[] cellTris, delete[] subGridIdx;
+		delete[] subGrids, delete[] subStart, delete[] subTris;
+		cellStart = cellTris = subStart = subTris = 0;
+		subGridIdx = 0, subGrids = 0;
+		Accel::Free();
+	}
+
+	uint* cellStart = 0;		// top level, cellCount + 1 offsets into cellTris
+	uint* cellTris = 0;
+	int* subGridIdx = 0;		// per top-level cell: index into subGrids, or -1
+	SubGrid* subGrids = 0;
+	uint* subStart = 0;			// cell offsets of all sub-grids, into subTris
+	uint* subTris = 0;
+	uint cellCount = 0, refCount = 0;
+	int subGridCount = 0;
+	uint subStartCount = 0, subRefCount = 0;	// lengths of subStart and subTris
+	int res[3] = { 1, 1, 1 };
+	float3 aabbMin, aabbMax, invCellSize;
+};
+
+}
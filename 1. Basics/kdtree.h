@@ -7,15 +7,16 @@ class KDTree : public Accel
 {
 public:
 	KDTree() = default;
-	KDTree(const char* objFile, uint* objIdxTracker, const float scale = 1, float3 offset = 0) : Accel(objFile, objIdxTracker, scale, offset) {}
+	KDTree(const char* objFile, int objIdx = -1, const float scale = 1, float3 offset = 0) : Accel(objFile, objIdx, scale, offset) {}
+	KDTree(shared_ptr<Mesh> mesh) : Accel(mesh) {}
 	void KDTree::Build()
 	{
+		delete[] nodes;
+		nodes = new Node[triCount * 2], nodesUsed = 1;
 		for (uint i = 0; i < triCount; i++) 
 		{
 			// populate triangle index array
 			triIdx[i] = i;
-			// calculate triangle centroids for partitioning
-			tri[i].centroid = (P[tri[i].vertexIdx0] + P[tri[i].vertexIdx1] + P[tri[i].vertexIdx2]) * 0.3333f;
 		}
 		// assign all triangles to root node
 		Node& root = nodes[rootNodeIdx];
@@ -27,15 +28,17 @@ public:
 		{
 			uint leafTriIdx = triIdx[first + i];
 			Tri& leafTri = tri[leafTriIdx];
-			root.aabbMin = fminf(root.aabbMin, P[leafTri.vertexIdx0]);
-			root.aabbMin = fminf(root.aabbMin, P[leafTri.vertexIdx1]);
-			root.aabbMin = fminf(root.aabbMin, P[leafTri.vertexIdx2]);
-			root.aabbMax = fmaxf(root.aabbMax, P[leafTri.vertexIdx0]);
-			root.aabbMax = fmaxf(root.aabbMax, P[leafTri.vertexIdx1]);
-			root.aabbMax = fmaxf(root.aabbMax, P[leafTri.vertexIdx2]);
+			root.aabbMin = fminf(root.aabbMin, Vertex(leafTri.vertexIdx0));
+			root.aabbMin = fminf(root.aabbMin, Vertex(leafTri.vertexIdx1));
+			root.aabbMin = fminf(root.aabbMin, Vertex(leafTri.vertexIdx2));
+			root.aabbMax = fmaxf(root.aabbMax, Vertex(leafTri.vertexIdx0));
+			root.aabbMax = fmaxf(root.aabbMax, Vertex(leafTri.vertexIdx1));
+			root.aabbMax = fmaxf(root.aabbMax, Vertex(leafTri.vertexIdx2));
 		}
 		// subdivide recursively
+		ComputeCentroids();
 		Subdivide(rootNodeIdx);
+		vector<float3>().swap(centroid);
 	}
 
 	void KDTree::Intersect(Ray& ray, uint nodeIdx, int* intersectionTests, int* traversalSteps)
@@ -52,7 +55,7 @@ public:
 			{
 				for (uint i = 0; i < node->triCount; i++)
 				{
-					IntersectTri(ray, tri[triIdx[node->leftFirst + i]]);
+					IntersectTri(ray, triIdx[node->leftFirst + i]);
 					(*intersectionTests)++;
 				}
 				if (stackPtr == 0) break; else node = stack[--stackPtr];
@@ -89,8 +92,7 @@ public:
 		float bestPos = 0, bestCost = 1e30f;
 		for (int axis = 0; axis < 3; axis++) for (uint i = 0; i < node.triCount; i++)
 		{
-			Tri& triangle = tri[triIdx[node.leftFirst + i]];
-			float candidatePos = triangle.centroid[axis];
+			float candidatePos = centroid[triIdx[node.leftFirst + i]][axis];
 			float cost = EvaluateSAH(node, axis, candidatePos);
 			if (cost < bestCost)
 				bestPos = candidatePos, bestAxis = axis, bestCost = cost;
@@ -106,7 +108,7 @@ public:
 		int j = i + node.triCount - 1;
 		while (i <= j)
 		{
-			if (tri[triIdx[i]].centroid[axis] < splitPos)
+			if (centroid[triIdx[i]][axis] < splitPos)
 				i++;
 			else
 				swap(triIdx[i], triIdx[j--]);
@@ -116,13 +118,13 @@ public:
 		int sfe = 0;
 		for (int l = node.leftFirst; l < node.leftFirst + node.triCount; l++) 
 		{
-			if (P[tri[triIdx[l]].vertexIdx0][axis] < splitPos ||
-				P[tri[triIdx[l]].vertexIdx1][axis] < splitPos ||
-				P[tri[triIdx[l]].vertexIdx2][axis] < splitPos) leftCount = l - node.leftFirst + 1;
+			if (Vertex(tri[triIdx[l]].vertexIdx0)[axis] < splitPos ||
+				Vertex(tri[triIdx[l]].vertexIdx1)[axis] < splitPos ||
+				Vertex(tri[triIdx[l]].vertexIdx2)[axis] < splitPos) leftCount = l - node.leftFirst + 1;
 			if (rightFirst == 0) {
-				if (P[tri[triIdx[l]].vertexIdx0][axis] >= splitPos ||
-					P[tri[triIdx[l]].vertexIdx1][axis] >= splitPos ||
-					P[tri[triIdx[l]].vertexIdx2][axis] >= splitPos) rightFirst = l;
+				if (Vertex(tri[triIdx[l]].vertexIdx0)[axis] >= splitPos ||
+					Vertex(tri[triIdx[l]].vertexIdx1)[axis] >= splitPos ||
+					Vertex(tri[triIdx[l]].vertexIdx2)[axis] >= splitPos) rightFirst = l;
 			}
 			sfe++;
 		}
@@ -0,0 +1,75 @@
+#pragma once
+#include "precomp.h"
+#include <sys/stat.h>
+#ifndef _MSC_VER
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace Tmpl8 {
+
+// -----------------------------------------------------------
+// Read-only file mapping with private, copy-on-write pages:
+// writes are allowed but never reach the file. Used for the
+// binary mesh format and the acceleration structure caches.
+// -----------------------------------------------------------
+class MappedFile
+{
+public:
+	MappedFile() = default;
+	~MappedFile() { Close(); }
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	MappedFile(MappedFile&& m) noexcept : data(m.data), size(m.size) { m.data = 0, m.size = 0; }
+	MappedFile& operator=(MappedFile&& m) noexcept
+	{
+		if (this != &m) Close(), data = m.data, size = m.size, m.data = 0, m.size = 0;
+		return *this;
+	}
+
+	bool Open(const char* file)
+	{
+		Close();
+#ifdef _MSC_VER
+		HANDLE handle = CreateFileA(file, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+		if (handle == INVALID_HANDLE_VALUE) return false;
+		LARGE_INTEGER fileSize;
+		GetFileSizeEx(handle, &fileSize);
+		HANDLE mapping = CreateFileMappingA(handle, 0, PAGE_WRITECOPY, 0, 0, 0);
+		CloseHandle(handle);
+		if (!mapping) return false;
+		void* view = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+		CloseHandle(mapping);
+		if (!view) return false;
+		size = (size_t)fileSize.QuadPart;
+#else
+		int fd = open(file, O_RDONLY);
+		if (fd < 0) return false;
+		struct stat st;
+		fstat(fd, &st);
+		size = (size_t)st.st_size;
+		void* view = size ? mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+		close(fd);
+		if (view == MAP_FAILED) { size = 0; return false; }
+#endif
+		data = (char*)view;
+		return true;
+	}
+
+	void Close()
+	{
+		if (!data) return;
+#ifdef _MSC_VER
+		UnmapViewOfFile(data);
+#else
+		munmap(data, size);
+#endif
+		data = 0, size = 0;
+	}
+
+	char* data = 0;
+	size_t size = 0;
+};
+
+}
@@ -0,0 +1,258 @@
+#pragma once
+#include "precomp.h"
+#include "objloader.h"
+#include "objects.h"
+#include "mappedfile.h"
+#include <memory>
+
+#define MESH_FILE_VERSION	2
+#define MESH_BINARY_CACHE			// text meshes are converted to <file>.mesh once, and mapped from then on
+//#define MESH_COMPRESSED			// 16-bit quantized positions and 32-bit octahedral normals, decoded on the fly
+
+namespace Tmpl8 {
+
+// binary mesh file: this header, then the Tri, TriNormals, position and normal
+// arrays exactly as they are laid out in memory, each on a 64-byte boundary
+struct MeshFileHeader
+{
+	char magic[4];					// "MESH"
+	uint version;					// MESH_FILE_VERSION
+	uint triSize;					// sizeof(Tri) of the writer; a layout change invalidates the file
+	uint triCount, vertexCount, normalCount;
+	uint64_t triOffset, triNormalOffset, posOffset, normalOffset;
+};
+
+// -----------------------------------------------------------
+// Triangle mesh, loaded once and shared read-only by every
+// acceleration structure built over it (via shared_ptr, so it
+// lives as long as the last structure that uses it).
+// Loads .obj, .tri and the binary .mesh format; the latter is
+// memory mapped and used in place.
+// -----------------------------------------------------------
+class Mesh
+{
+public:
+	Mesh() = default;
+	Mesh(const char* file, int objIdx = -1, const float scale = 1, float3 offset = float3(0)) : objIdx(objIdx)
+	{
+		Timer t;
+		const char* ext = strrchr(file, '.');
+		if (ext && !strcmp(ext, ".mesh")) Map(file);
+		else
+		{
+#ifdef MESH_BINARY_CACHE
+			// the cache is only used when it is newer than its source
+			const string binFile = string(file) + ".mesh";
+			struct stat src, bin;
+			bool fresh = stat(file, &src) == 0 && stat(binFile.c_str(), &bin) == 0 && bin.st_mtime >= src.st_mtime;
+			if (!fresh || !Map(binFile.c_str()))
+			{
+				if (!Parse(file)) return;
+				Save(binFile.c_str());
+			}
+#else
+			if (!Parse(file)) return;
+#endif
+		}
+		// mapped pages are copy-on-write: a transform only copies the positions
+		if (scale != 1 || offset.x != 0 || offset.y != 0 || offset.z != 0)
+			for (uint i = 0; i < vertexCount; i++) P[i] = P[i] * scale + offset;
+#ifdef MESH_COMPRESSED
+		Compress();
+#endif
+		printf("Mesh: %s, %u triangles%s, ready in %.1f ms\n", file, triCount, mapping.data ? " (mapped)" : "", t.elapsed() * 1000);
+	}
+	~Mesh()
+	{
+		// a mapping is released by its own destructor
+		if (!mapping.data) FREE64(tri), FREE64(triNormals), FREE64(P), FREE64(N);
+		FREE64(Pq), FREE64(Nq);
+	}
+	Mesh(const Mesh&) = delete;
+	Mesh& operator=(const Mesh&) = delete;
+
+	// parse a text mesh into freshly allocated arrays
+	bool Parse(const char* file)
+	{
+		OBJLoader text;
+		const char* ext = strrchr(file, '.');
+		if (!(ext && !strcmp(ext, ".tri") ? text.LoadTri(file, 1, 0) : text.Load(file, 1, 0))) return false;
+		// the parse counted everything: allocate exactly that, cacheline aligned
+		triCount = text.triCount;
+		vertexCount = (uint)text.P.size(), normalCount = (uint)text.N.size();
+		tri = (Tri*)MALLOC64(AlignedSize(triCount * sizeof(Tri)));
+		triNormals = (TriNormals*)MALLOC64(AlignedSize(triCount * sizeof(TriNormals)));
+		P = (float3*)MALLOC64(AlignedSize(vertexCount * sizeof(float3)));
+		N = (float3*)MALLOC64(AlignedSize(normalCount * sizeof(float3)));
+		if (vertexCount) memcpy(P, text.P.data(), vertexCount * sizeof(float3));
+		if (normalCount) memcpy(N, text.N.data(), normalCount * sizeof(float3));
+		for (uint i = 0; i < triCount; i++)
+		{
+			const OBJLoader::Corner* k = &text.corners[i * 3];
+			tri[i].vertexIdx0 = k[0].v, triNormals[i].normalIdx0 = k[0].n;
+			tri[i].vertexIdx1 = k[1].v, triNormals[i].normalIdx1 = k[1].n;
+			tri[i].vertexIdx2 = k[2].v, triNormals[i].normalIdx2 = k[2].n;
+		}
+		return true;
+	}
+
+	// write the binary format
+	bool Save(const char* file) const
+	{
+		if (Pq) return false; // the float data of a compressed mesh is gone
+		FILE* f = fopen(file, "wb");
+		if (!f) return false;
+		MeshFileHeader h = {};
+		memcpy(h.magic, "MESH", 4);
+		h.version = MESH_FILE_VERSION, h.triSize = sizeof(Tri);
+		h.triCount = triCount, h.vertexCount = vertexCount, h.normalCount = normalCount;
+		h.triOffset = AlignedSize(sizeof(MeshFileHeader));
+		h.triNormalOffset = h.triOffset + AlignedSize(triCount * sizeof(Tri));
+		h.posOffset = h.triNormalOffset + AlignedSize(triCount * sizeof(TriNormals));
+		h.normalOffset = h.posOffset + AlignedSize(vertexCount * sizeof(float3));
+		const uint64_t size = h.normalOffset + AlignedSize(normalCount * sizeof(float3));
+		// assemble in memory so padding is zeroed, then write in one go
+		char* data = (char*)calloc(size, 1);
+		memcpy(data, &h, sizeof(h));
+		if (triCount) memcpy(data + h.triOffset, tri, triCount * sizeof(Tri));
+		if (triCount) memcpy(data + h.triNormalOffset, triNormals, triCount * sizeof(TriNormals));
+		if (vertexCount) memcpy(data + h.posOffset, P, vertexCount * sizeof(float3));
+		if (normalCount) memcpy(data + h.normalOffset, N, normalCount * sizeof(float3));
+		bool ok = fwrite(data, 1, size, f) == size;
+		fclose(f);
+		free(data);
+		return ok;
+	}
+
+	// map a binary mesh file; the arrays point straight into the mapping
+	bool Map(const char* file)
+	{
+		if (!mapping.Open(file)) return false;
+		const MeshFileHeader& h = *(const MeshFileHeader*)mapping.data;
+		// each array must be 64-byte aligned, inside the file, and start after the previous one ends
+		uint64_t end = sizeof(MeshFileHeader);
+		auto section = [&](uint64_t offset, uint64_t bytes)
+		{
+			if ((offset & 63) || offset < end || offset > mapping.size || bytes > mapping.size - offset) return false;
+			end = offset + bytes;
+			return true;
+		};
+		if (mapping.size < sizeof(MeshFileHeader) || memcmp(h.magic, "MESH", 4) || h.version != MESH_FILE_VERSION || h.triSize != sizeof(Tri) ||
+			!section(h.triOffset, (uint64_t)h.triCount * sizeof(Tri)) ||
+			!section(h.triNormalOffset, (uint64_t)h.triCount * sizeof(TriNormals)) ||
+			!section(h.posOffset, (uint64_t)h.vertexCount * sizeof(float3)) ||
+			!section(h.normalOffset, (uint64_t)h.normalCount * sizeof(float3)))
+		{
+			printf("Mesh: %s is not a valid version %i mesh file, ignored\n", file, MESH_FILE_VERSION);
+			mapping.Close();
+			return false;
+		}
+		triCount = h.triCount, vertexCount = h.vertexCount, normalCount = h.normalCount;
+		tri = (Tri*)(mapping.data + h.triOffset);
+		triNormals = (TriNormals*)(mapping.data + h.triNormalOffset);
+		P = (float3*)(mapping.data + h.posOffset);
+		N = (float3*)(mapping.data + h.normalOffset);
+		return true;
+	}
+
+	// quantize positions to 16 bits per axis within the mesh bounds and normals to
+	// 32-bit octahedral vectors; the float arrays are released (or left unmapped)
+	void Compress()
+	{
+		float3 qMax(-1e30f);
+		qMin = float3(1e30f);
+		for (uint i = 0; i < vertexCount; i++) qMin = fminf(qMin, P[i]), qMax = fmaxf(qMax, P[i]);
+		qScale = (qMax - qMin) * (1.0f / 65535);
+		const float3 invScale(qScale.x > 0 ? 1 / qScale.x : 0, qScale.y > 0 ? 1 / qScale.y : 0, qScale.z > 0 ? 1 / qScale.z : 0);
+		Pq = (ushort*)MALLOC64(AlignedSize(vertexCount * 3 * sizeof(ushort)));
+		Nq = (uint*)MALLOC64(AlignedSize(normalCount * sizeof(uint)));
+		for (uint i = 0; i < vertexCount; i++)
+		{
+			const float3 q = (P[i] - qMin) * invScale;
+			Pq[i * 3 + 0] = (ushort)min(q.x + 0.5f, 65535.0f);
+			Pq[i * 3 + 1] = (ushort)min(q.y + 0.5f, 65535.0f);
+			Pq[i * 3 + 2] = (ushort)min(q.z + 0.5f, 65535.0f);
+		}
+		for (uint i = 0; i < normalCount; i++) Nq[i] = EncodeNormal(N[i]);
+		if (!mapping.data) FREE64(P), FREE64(N);
+		P = N = 0;
+		printf("Mesh: vertex data compressed from %.1f KB to %.1f KB\n", (vertexCount + normalCount) * sizeof(float3) / 1024.0f,
+			(vertexCount * 3 * sizeof(ushort) + normalCount * sizeof(uint)) / 1024.0f);
+	}
+
+	static float3 DecodePosition(const ushort* q, const float3 qMin, const float3 qScale)
+	{
+		return qMin + float3(q[0], q[1], q[2]) * qScale;
+	}
+
+	// octahedral encoding: project onto |x| + |y| + |z| = 1, fold the lower half
+	// over the upper one, and store x and y as 16-bit fixed point
+	static uint EncodeNormal(const float3 n)
+	{
+		const float l1 = fabs(n.x) + fabs(n.y) + fabs(n.z);
+		if (l1 == 0) return EncodeNormal(float3(0, 0, 1));
+		float x = n.x / l1, y = n.y / l1;
+		if (n.z < 0)
+		{
+			const float fx = (1 - fabs(y)) * (x >= 0 ? 1 : -1), fy = (1 - fabs(x)) * (y >= 0 ? 1 : -1);
+			x = fx, y = fy;
+		}
+		return (uint)((x * 0.5f + 0.5f) * 65535 + 0.5f) + ((uint)((y * 0.5f + 0.5f) * 65535 + 0.5f) << 16);
+	}
+	static float3 DecodeNormal(const uint e)
+	{
+		const float x = (e & 65535) * (2.0f / 65535) - 1, y = (e >> 16) * (2.0f / 65535) - 1;
+		float3 n(x, y, 1 - fabs(x) - fabs(y));
+		const float t = max(-n.z, 0.0f);
+		n.x += n.x >= 0 ? -t : t;
+		n.y += n.y >= 0 ? -t : t;
+		return normalize(n);
+	}
+
+	// FNV-1a over the vertex positions and the triangle vertex indices: everything
+	// a build depends on. Computed on first use; the mesh doesn't change afterwards.
+	uint64_t Hash()
+	{
+		if (hash) return hash;
+		uint64_t h = 14695981039346656037ull;
+#ifdef MESH_COMPRESSED
+		const uint* q = (const uint*)&qMin, * s = (const uint*)&qScale;
+		for (int i = 0; i < 3; i++) h = (h ^ q[i]) * 1099511628211ull, h = (h ^ s[i]) * 1099511628211ull;
+		for (uint i = 0; i < vertexCount * 3; i++) h = (h ^ Pq[i]) * 1099511628211ull;
+#else
+		const uint* p = (const uint*)P;
+		for (uint i = 0; i < vertexCount * 3; i++) h = (h ^ p[i]) * 1099511628211ull;
+#endif
+		for (uint i = 0; i < triCount; i++)
+		{
+			h = (h ^ tri[i].vertexIdx0) * 1099511628211ull;
+			h = (h ^ tri[i].vertexIdx1) * 1099511628211ull;
+			h = (h ^ tri[i].vertexIdx2) * 1099511628211ull;
+		}
+		return hash = h;
+	}
+
+	// offline conversion of an .obj or .tri file to the binary format ("--convert <src> <dst>");
+	// loading a text mesh writes its <file>.mesh cache anyway, this just picks the name
+	static bool Convert(const char* srcFile, const char* dstFile)
+	{
+		Mesh mesh;
+		return mesh.Parse(srcFile) && mesh.triCount > 0 && mesh.Save(dstFile);
+	}
+
+	// aligned_alloc wants a multiple of the alignment
+	static size_t AlignedSize(size_t bytes) { return (bytes + 63) & ~(size_t)63; }
+
+	Tri* tri = 0;
+	TriNormals* triNormals = 0;
+	int objIdx = -1;			// scene object reported by hits on this mesh; ray.primIdx has the triangle
+	float3* P = 0, * N = 0;		// 64-byte aligned, exactly vertexCount / normalCount long
+	ushort* Pq = 0;				// MESH_COMPRESSED: replaces P, dequantized as qMin + q * qScale
+	uint* Nq = 0;				// MESH_COMPRESSED: replaces N
+	float3 qMin, qScale;
+	uint triCount = 0, vertexCount = 0, normalCount = 0;
+	MappedFile mapping;		// the binary file, if the arrays live there
+	uint64_t hash = 0;
+};
+
+}
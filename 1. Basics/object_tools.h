@@ -40,7 +40,9 @@ namespace Tmpl8 {
 		union { struct { float3 rD; float d2; }; __m128 rD4; };
 #endif
 		float t = 1e30f;
-		int objIdx = -1;
+		int objIdx = -1; // hit: entry in the scene's object table
+		int primIdx = -1; // mesh hits: index of the triangle in its mesh
+		float u, v; // mesh hits: barycentric coordinates of the hit point
 		bool inside = false; // true when in medium
 	};
 
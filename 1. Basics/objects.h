@@ -13,10 +13,11 @@ namespace Tmpl8 {
 		}
 		void Intersect(Ray& ray) const
 		{
-#if 1
-			const __m128 oc = _mm_sub_ps(ray.O4, _mm_set_ps(1, 1, this->pos.y, -1.8f));
-			const float b = _mm_dp_ps(oc, ray.D4, 0xFF).m128_f32[0];
-			const float c = _mm_dp_ps(oc, oc, 0xFF).m128_f32[0];
+#ifdef SPEEDTRIX
+			// xyz only: the sphere can be anywhere now that it can live in a BVH
+			const __m128 oc = _mm_sub_ps(ray.O4, this->pos4);
+			const float b = _mm_dp_ps(oc, ray.D4, 0x71).m128_f32[0];
+			const float c = _mm_dp_ps(oc, oc, 0x71).m128_f32[0] - this->r2;
 #else
 			float3 oc = ray.O - this->pos;
 			float b = dot(oc, ray.D);
@@ -37,10 +38,10 @@ namespace Tmpl8 {
 		}
 		bool IsOccluded(const Ray& ray) const
 		{
-#if 1
-			const __m128 oc = _mm_sub_ps(ray.O4, _mm_set_ps(1, 1, this->pos.y, -1.8f));
-			const float b = _mm_dp_ps(oc, ray.D4, 0xFF).m128_f32[0];
-			const float c = _mm_dp_ps(oc, oc, 0xFF).m128_f32[0];
+#ifdef SPEEDTRIX
+			const __m128 oc = _mm_sub_ps(ray.O4, this->pos4);
+			const float b = _mm_dp_ps(oc, ray.D4, 0x71).m128_f32[0];
+			const float c = _mm_dp_ps(oc, oc, 0x71).m128_f32[0] - this->r2;
 #else
 			float3 oc = ray.O - this->pos;
 			float b = dot(oc, ray.D);
@@ -412,6 +413,7 @@ namespace Tmpl8 {
 				if (t1 > 0) t = min(t, t1);
 				if (t2 > 0) t = min(t, t2);
 			}
+			if (t == 1e20) return; // no root in front of the ray
 			float ft = (float)t;
 			if (ft > 0 && ft < ray.t) ray.t = ft, ray.objIdx = objIdx;
 		}
@@ -516,12 +518,15 @@ namespace Tmpl8 {
 
 
 	// IMPLEMENT WITH MESHESSSS
+	// render-time triangle: just what intersection reads. Normal indices are only
+	// needed for shading and live in a separate array; objIdx follows from the index.
 	struct Tri
 	{
-		int objIdx = -1;
-		uint vertexIdx0, vertexIdx1, vertexIdx2; 
+		uint vertexIdx0, vertexIdx1, vertexIdx2;
+	};
+	struct TriNormals
+	{
 		uint normalIdx0, normalIdx1, normalIdx2;
-		float3 centroid;
 	};
 
 
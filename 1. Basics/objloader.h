@@ -0,0 +1,238 @@
+#pragma once
+#include "precomp.h"
+
+#define OBJ_CHUNK_SIZE	(1 << 20)	// bytes of text per parallel work item
+
+namespace Tmpl8 {
+
+// -----------------------------------------------------------
+// Parallel OBJ parser
+// The file is read in one go and cut into chunks at line ends;
+// chunks are parsed in parallel into local arrays, which are
+// concatenated afterwards. Supports v, vn, and faces written as
+// v, v/vt, v//vn or v/vt/vn, negative (relative) indices, and
+// polygons of any size (triangulated as a fan). Faces without
+// normals get their geometric normal. Also reads the raw .tri
+// triangle lists (LoadTri).
+// -----------------------------------------------------------
+class OBJLoader
+{
+public:
+	// one face corner, 0-based; relative indices count back from the chunk's
+	// own vertex count and are fixed up once the chunk offsets are known
+	struct Corner { int v, n; bool relV, relN; };
+	struct Chunk
+	{
+		const char* start, * end;
+		vector<float3> P, N;
+		vector<Corner> corners;		// three per triangle
+	};
+
+	bool Load(const char* objFile, const float scale, const float3 offset)
+	{
+		Timer t;
+		FILE* file = fopen(objFile, "rb");
+		if (!file) return false;
+		fseek(file, 0, SEEK_END);
+		size_t size = ftell(file);
+		fseek(file, 0, SEEK_SET);
+		char* text = new char[size + 1];
+		size = fread(text, 1, size, file);
+		text[size] = 0;
+		fclose(file);
+		// cut into chunks, each ending right after a newline
+		vector<Chunk> chunks;
+		for (const char* p = text, * end = text + size; p < end;)
+		{
+			const char* q = min(p + OBJ_CHUNK_SIZE, end);
+			while (q < end && q[-1] != '\n') q++;
+			chunks.push_back(Chunk());
+			chunks.back().start = p, chunks.back().end = q;
+			p = q;
+		}
+		const int chunkCount = (int)chunks.size();
+#pragma omp parallel for schedule(dynamic)
+		for (int i = 0; i < chunkCount; i++) ParseChunk(chunks[i], scale, offset);
+		// prefix sums over the chunk sizes, then resolve relative indices
+		vector<uint> firstP(chunkCount + 1, 0), firstN(chunkCount + 1, 0), firstCorner(chunkCount + 1, 0);
+		for (int i = 0; i < chunkCount; i++)
+		{
+			firstP[i + 1] = firstP[i] + (uint)chunks[i].P.size();
+			firstN[i + 1] = firstN[i] + (uint)chunks[i].N.size();
+			firstCorner[i + 1] = firstCorner[i] + (uint)chunks[i].corners.size();
+		}
+		P.resize(firstP[chunkCount]);
+		N.resize(firstN[chunkCount]);
+		corners.resize(firstCorner[chunkCount]);
+#pragma omp parallel for schedule(dynamic)
+		for (int i = 0; i < chunkCount; i++)
+		{
+			Chunk& c = chunks[i];
+			if (!c.P.empty()) memcpy(&P[firstP[i]], c.P.data(), c.P.size() * sizeof(float3));
+			if (!c.N.empty()) memcpy(&N[firstN[i]], c.N.data(), c.N.size() * sizeof(float3));
+			for (size_t j = 0; j < c.corners.size(); j++)
+			{
+				Corner k = c.corners[j];
+				if (k.relV) k.v += firstP[i];
+				if (k.relN) k.n += firstN[i];
+				corners[firstCorner[i] + j] = k;
+			}
+		}
+		delete[] text;
+		// drop triangles that reference missing vertices; give normal-less ones a face normal
+		triCount = 0;
+		const int vertexCount = (int)P.size(), normalCount = (int)N.size();
+		for (size_t i = 0; i < corners.size(); i += 3)
+		{
+			Corner* k = &corners[i];
+			bool valid = true;
+			for (int j = 0; j < 3; j++) valid &= k[j].v >= 0 && k[j].v < vertexCount;
+			if (!valid) continue;
+			if (k[0].n < 0 || k[1].n < 0 || k[2].n < 0 || k[0].n >= normalCount || k[1].n >= normalCount || k[2].n >= normalCount)
+			{
+				k[0].n = k[1].n = k[2].n = (int)N.size();
+				N.push_back(normalize(cross(P[k[1].v] - P[k[0].v], P[k[2].v] - P[k[0].v])));
+			}
+			if (i != triCount * 3) memcpy(&corners[triCount * 3], k, 3 * sizeof(Corner));
+			triCount++;
+		}
+		corners.resize(triCount * 3);
+		printf("OBJ: %s, %u vertices, %u triangles, loaded in %.1f ms\n", objFile, (uint)P.size(), triCount, t.elapsed() * 1000);
+		return true;
+	}
+
+	// raw triangle list: nine coordinates per line, no shared vertices, no normals
+	bool LoadTri(const char* triFile, const float scale, const float3 offset)
+	{
+		Timer t;
+		FILE* file = fopen(triFile, "rb");
+		if (!file) return false;
+		fseek(file, 0, SEEK_END);
+		size_t size = ftell(file);
+		fseek(file, 0, SEEK_SET);
+		char* text = new char[size + 1];
+		size = fread(text, 1, size, file);
+		text[size] = 0;
+		fclose(file);
+		P.clear(), N.clear(), corners.clear();
+		for (const char* p = text, * end = text + size; p < end; p = NextLine(p, end))
+		{
+			float f[9];
+			int count = 0;
+			for (; count < 9; count++)
+			{
+				while (*p == ' ' || *p == '\t') p++;
+				if (!(*p == '-' || *p == '+' || *p == '.' || (*p >= '0' && *p <= '9'))) break;
+				f[count] = ParseFloat(p);
+			}
+			if (count < 9) continue; // blank line or not a triangle
+			float3 v[3] = { float3(f[0], f[1], f[2]), float3(f[3], f[4], f[5]), float3(f[6], f[7], f[8]) };
+			const int first = (int)P.size(), n = (int)N.size();
+			for (int i = 0; i < 3; i++)
+			{
+				P.push_back(v[i] * scale + offset);
+				corners.push_back({ first + i, n, false, false });
+			}
+			N.push_back(normalize(cross(v[1] - v[0], v[2] - v[0])));
+		}
+		delete[] text;
+		triCount = (uint)corners.size() / 3;
+		printf("TRI: %s, %u triangles, loaded in %.1f ms\n", triFile, triCount, t.elapsed() * 1000);
+		return true;
+	}
+
+	void ParseChunk(Chunk& c, const float scale, const float3 offset)
+	{
+		vector<Corner> polygon;
+		for (const char* p = c.start; p < c.end; p = NextLine(p, c.end))
+		{
+			while (*p == ' ' || *p == '\t') p++;
+			if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t'))
+			{
+				float3 v;
+				p += 2, v.x = ParseFloat(p), v.y = ParseFloat(p), v.z = ParseFloat(p);
+				c.P.push_back(v * scale + offset);
+			}
+			else if (p[0] == 'v' && p[1] == 'n')
+			{
+				float3 n;
+				p += 2, n.x = ParseFloat(p), n.y = ParseFloat(p), n.z = ParseFloat(p);
+				c.N.push_back(n);
+			}
+			else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t'))
+			{
+				// corners: v, v/vt, v//vn or v/vt/vn
+				polygon.clear();
+				p++;
+				while (1)
+				{
+					while (*p == ' ' || *p == '\t') p++;
+					if (!(*p == '-' || (*p >= '0' && *p <= '9'))) break;
+					Corner k;
+					int v = ParseInt(p), n = 0;
+					if (*p == '/')
+					{
+						p++;
+						if (*p != '/') ParseInt(p); // texture coordinates are not used
+						if (*p == '/') p++, n = ParseInt(p);
+					}
+					k.relV = v < 0, k.v = v < 0 ? (int)c.P.size() + v : v - 1;
+					k.relN = n < 0, k.n = n < 0 ? (int)c.N.size() + n : n - 1;
+					polygon.push_back(k);
+				}
+				// fan triangulation
+				for (size_t i = 2; i < polygon.size(); i++)
+				{
+					c.corners.push_back(polygon[0]);
+					c.corners.push_back(polygon[i - 1]);
+					c.corners.push_back(polygon[i]);
+				}
+			}
+			// vt, comments, groups, materials etc. are skipped
+		}
+	}
+
+	static const char* NextLine(const char* p, const char* end)
+	{
+		while (p < end && *p != '\n') p++;
+		return p + 1;
+	}
+
+	static int ParseInt(const char*& p)
+	{
+		bool negative = *p == '-';
+		if (*p == '-' || *p == '+') p++;
+		int v = 0;
+		while (*p >= '0' && *p <= '9') v = v * 10 + (*p++ - '0');
+		return negative ? -v : v;
+	}
+
+	static float ParseFloat(const char*& p)
+	{
+		while (*p == ' ' || *p == '\t') p++;
+		bool negative = *p == '-';
+		if (*p == '-' || *p == '+') p++;
+		double v = 0, scale = 1;
+		while (*p >= '0' && *p <= '9') v = v * 10 + (*p++ - '0');
+		if (*p == '.')
+		{
+			p++;
+			while (*p >= '0' && *p <= '9') v = v * 10 + (*p++ - '0'), scale *= 10;
+		}
+		if (*p == 'e' || *p == 'E')
+		{
+			p++;
+			int e = ParseInt(p);
+			static const double powers[] = { 1, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16 };
+			double p10 = abs(e) <= 16 ? powers[abs(e)] : pow(10.0, abs(e));
+			if (e < 0) scale *= p10; else v *= p10;
+		}
+		return (float)(negative ? -v / scale : v / scale);
+	}
+
+	vector<float3> P, N;
+	vector<Corner> corners;		// three per triangle, all indices absolute
+	uint triCount = 0;
+};
+
+}
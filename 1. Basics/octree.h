@@ -3,225 +3,286 @@
 #include "tmplmath.h"
 //#include "objects.h"
 
+#define OCTREE_MAX_DEPTH	16		// hard limit; straddling triangles could otherwise recurse forever
+#define OCTREE_LEAF_SIZE	4		// nodes with this many triangles or fewer always become leaves
+#define OCTREE_BINS			16		// split plane candidates per axis
+#define OCTREE_SAH_SPLIT			// comment out to split every node at its midpoint
+#define OCTREE_C_TRAV		4.0f	// cost of visiting a node, relative to a triangle test
+
 namespace Tmpl8 {
 
+// sparse octree node: only non-empty children are stored, contiguously, and
+// childMask tells which octants they are. Interior nodes store the split point
+// shared by their children; leaves store a range of triangle references.
+struct OctreeNode
+{
+	float3 split;
+	uint first;							// interior: first stored child; leaf: first triangle reference
+	uint triCount : 24, childMask : 8;	// child index bits: x = 4, y = 2, z = 1
+	bool isLeaf() { return childMask == 0; }
+};
+
 class Octree : public Accel
 {
 public:
 	Octree() = default;
-	Octree(const char* objFile, uint* objIdxTracker, const float scale = 1, float3 offset = 0) : Accel(objFile, objIdxTracker, scale, offset) {}
+	Octree(const char* objFile, int objIdx = -1, const float scale = 1, float3 offset = 0) : Accel(objFile, objIdx, scale, offset) {}
+	Octree(shared_ptr<Mesh> mesh) : Accel(mesh) {}
 
 	void Octree::Build()
 	{
-		//nodes = new Node[triCount * 4];
-		for (uint i = 0; i < triCount; i++)
-		{
-			// populate triangle index array
-			triIdx[i] = i;
-			// calculate triangle centroids for partitioning
-			tri[i].centroid = (P[tri[i].vertexIdx0] + P[tri[i].vertexIdx1] + P[tri[i].vertexIdx2]) * 0.3333f;
-		}
+		Timer t;
+		// node and reference counts are only known after the build: triangles that
+		// straddle a split plane are referenced by every octant they overlap
+		vector<OctreeNode> buildNodes(1);
+		vector<uint> refs, rootTris(triCount);
+		for (uint i = 0; i < triCount; i++) rootTris[i] = i;
 		// assign all triangles to root node
-		Node& root = nodes[rootNodeIdx];
-		root.leftFirst = 0, root.triCount = triCount;
-		// get bounds
-		root.aabbMin = float3(1e30f);
-		root.aabbMax = float3(-1e30f);
-		for (uint first = root.leftFirst, i = 0; i < root.triCount; i++)
+		aabbMin = float3(1e30f);
+		aabbMax = float3(-1e30f);
+		for (uint i = 0; i < triCount; i++)
 		{
-			uint leafTriIdx = triIdx[first + i];
-			Tri& leafTri = tri[leafTriIdx];
-			root.aabbMin = fminf(root.aabbMin, P[leafTri.vertexIdx0]);
-			root.aabbMin = fminf(root.aabbMin, P[leafTri.vertexIdx1]);
-			root.aabbMin = fminf(root.aabbMin, P[leafTri.vertexIdx2]);
-			root.aabbMax = fmaxf(root.aabbMax, P[leafTri.vertexIdx0]);
-			root.aabbMax = fmaxf(root.aabbMax, P[leafTri.vertexIdx1]);
-			root.aabbMax = fmaxf(root.aabbMax, P[leafTri.vertexIdx2]);
+			float3 tmin, tmax;
+			GetTriBounds(i, tmin, tmax);
+			aabbMin = fminf(aabbMin, tmin);
+			aabbMax = fmaxf(aabbMax, tmax);
 		}
 		// subdivide recursively
-		Subdivide(rootNodeIdx);
+		maxDepth = 0;
+		Subdivide(rootNodeIdx, rootTris, aabbMin, aabbMax, 0, buildNodes, refs);
+		// move the result into the flat arrays used by traversal
+		delete[] octNodes;
+		delete[] triIdx;
+		nodesUsed = (int)buildNodes.size();
+		octNodes = new OctreeNode[nodesUsed];
+		memcpy(octNodes, buildNodes.data(), nodesUsed * sizeof(OctreeNode));
+		refCount = (uint)refs.size();
+		triIdx = new uint[max(refCount, 1u)];
+		if (refCount) memcpy(triIdx, refs.data(), refCount * sizeof(uint));
+		printf("Octree: %i nodes, %u triangle refs (%.2f per tri), depth %u, %.1f KB, built in %.1f ms\n",
+			nodesUsed, refCount, (float)refCount / max(triCount, 1u), maxDepth,
+			(nodesUsed * sizeof(OctreeNode) + refCount * sizeof(uint)) / 1024.0f, t.elapsed() * 1000);
 	}
 
-	void Octree::Subdivide(uint nodeIdx)
+	void Octree::Subdivide(uint nodeIdx, vector<uint>& nodeTris, float3 bmin, float3 bmax, uint depth, vector<OctreeNode>& buildNodes, vector<uint>& refs)
 	{
-		Node& node = nodes[nodeIdx];
-		float3 splitPos;
-		float bestCost = 1e30f;
-		for (int axis = 0; axis < 3; axis++)
+		const uint count = (uint)nodeTris.size();
+		maxDepth = max(maxDepth, depth);
+		if (count > OCTREE_LEAF_SIZE && depth < OCTREE_MAX_DEPTH)
 		{
-			for (uint i = 0; i < node.triCount; i++)
+			float3 split = FindSplit(nodeTris, bmin, bmax);
+			// distribute the triangles over every octant their bounds overlap
+			vector<uint> childTris[8];
+			for (uint idx : nodeTris)
 			{
-				Tri& triangle = tri[triIdx[node.leftFirst + i]];
-				float candidatePos = triangle.centroid[axis];
-				float cost = 6000; //EvaluateSAH(node, axis, candidatePos);
-				if (cost < bestCost)
+				float3 tmin, tmax;
+				GetTriBounds(idx, tmin, tmax);
+				uint lower = 0, upper = 0;
+				for (int a = 0; a < 3; a++)
 				{
-					splitPos[axis] = candidatePos, bestCost = cost;
+					if (tmin[a] < split[a]) lower |= 4 >> a;
+					if (tmax[a] >= split[a]) upper |= 4 >> a;
 				}
+				for (uint c = 0; c < 8; c++)
+					if ((c & ~upper) == 0 && (~c & ~lower & 7) == 0) childTris[c].push_back(idx);
+			}
+			// only split when the expected cost of the children beats a leaf (both scaled by the parent area)
+			float splitCost = OCTREE_C_TRAV * HalfArea(bmin, bmax);
+			float leafCost = count * HalfArea(bmin, bmax);
+			for (uint c = 0; c < 8; c++)
+			{
+				float3 cmin, cmax;
+				GetChildBounds(c, bmin, bmax, split, cmin, cmax);
+				splitCost += childTris[c].size() * HalfArea(cmin, cmax);
+			}
+			if (splitCost < leafCost)
+			{
+				// create child nodes for the non-empty octants only
+				uint childMask = 0;
+				for (uint c = 0; c < 8; c++) if (!childTris[c].empty()) childMask |= 1 << c;
+				uint firstChildIdx = (uint)buildNodes.size();
+				OctreeNode& node = buildNodes[nodeIdx];
+				node.split = split;
+				node.first = firstChildIdx;
+				node.triCount = 0, node.childMask = childMask;
+				buildNodes.resize(firstChildIdx + _mm_popcnt_u32(childMask));
+				// the parent list is no longer needed; free it before recursing
+				vector<uint>().swap(nodeTris);
+				for (uint c = 0, childIdx = firstChildIdx; c < 8; c++) if (childMask & (1 << c))
+				{
+					float3 cmin, cmax;
+					GetChildBounds(c, bmin, bmax, split, cmin, cmax);
+					Subdivide(childIdx++, childTris[c], cmin, cmax, depth + 1, buildNodes, refs);
+				}
+				return;
 			}
 		}
-		float3 e = node.aabbMax - node.aabbMin;
-		float parentArea = e.x * e.x + e.y * e.y + e.z * e.z;
-		float parentCost = node.triCount * parentArea;
-		if (bestCost >= parentCost) return;
-
-		// Organize triangles for first octant
-		int leftFirstArray[9];
-		leftFirstArray[0] = node.leftFirst;
-		ArrangeTriangles(node, splitPos, leftFirstArray, 1);
-		ArrangeTriangles(node, splitPos, leftFirstArray, 2);
-		ArrangeTriangles(node, splitPos, leftFirstArray, 3);
-		ArrangeTriangles(node, splitPos, leftFirstArray, 4);
-		ArrangeTriangles(node, splitPos, leftFirstArray, 5);
-		ArrangeTriangles(node, splitPos, leftFirstArray, 6);
-		ArrangeTriangles(node, splitPos, leftFirstArray, 7);
-		ArrangeTriangles(node, splitPos, leftFirstArray, 8);
+		// make leaf
+		OctreeNode& leaf = buildNodes[nodeIdx];
+		leaf.first = (uint)refs.size();
+		leaf.triCount = count, leaf.childMask = 0;
+		refs.insert(refs.end(), nodeTris.begin(), nodeTris.end());
+	}
 
-		// abort split if at least 6 octants are empty
-		int emptyCount = 0;
-		if (leftFirstArray[1] - node.triCount == 0) emptyCount++;
-		for (int i = 2; i <= 8; i++)
+	float3 Octree::FindSplit(const vector<uint>& nodeTris, float3 bmin, float3 bmax)
+	{
+		float3 split = (bmin + bmax) * 0.5f;
+#ifdef OCTREE_SAH_SPLIT
+		// binned SAH, per axis; triangles that straddle a candidate plane count on both sides
+		float3 e = bmax - bmin;
+		for (int a = 0; a < 3; a++)
 		{
-			if (leftFirstArray[i] - leftFirstArray[i - 1] == 0) emptyCount++;
+			if (e[a] <= 0) continue;
+			uint startBin[OCTREE_BINS] = { 0 }, endBin[OCTREE_BINS] = { 0 };
+			float scale = OCTREE_BINS / e[a];
+			for (uint idx : nodeTris)
+			{
+				float3 tmin, tmax;
+				GetTriBounds(idx, tmin, tmax);
+				startBin[clamp((int)((tmin[a] - bmin[a]) * scale), 0, OCTREE_BINS - 1)]++;
+				endBin[clamp((int)((tmax[a] - bmin[a]) * scale), 0, OCTREE_BINS - 1)]++;
+			}
+			// half-area of a slab of the node, as a function of its length along this axis
+			float capArea = e[(a + 1) % 3] * e[(a + 2) % 3];
+			float sideLength = e[(a + 1) % 3] + e[(a + 2) % 3];
+			uint rightCount[OCTREE_BINS];
+			rightCount[OCTREE_BINS - 1] = endBin[OCTREE_BINS - 1];
+			for (int i = OCTREE_BINS - 2; i >= 0; i--) rightCount[i] = rightCount[i + 1] + endBin[i];
+			float bestCost = 1e30f;
+			uint leftCount = 0;
+			for (int i = 1; i < OCTREE_BINS; i++)
+			{
+				leftCount += startBin[i - 1];
+				float leftLength = i * e[a] / OCTREE_BINS;
+				float cost = leftCount * (capArea + leftLength * sideLength) +
+					rightCount[i] * (capArea + (e[a] - leftLength) * sideLength);
+				if (cost < bestCost) split[a] = bmin[a] + leftLength, bestCost = cost;
+			}
 		}
-		if (emptyCount >= 6) return;
+#endif
+		return split;
+	}
 
-		// Create child nodes
-		int firstChildIdx = nodesUsed++;
-		nodes[firstChildIdx].leftFirst = node.leftFirst;
-		nodes[firstChildIdx].triCount = leftFirstArray[1] - node.leftFirst;
-		for (int i = 2; i <= 8; i++)
+	void Octree::GetChildBounds(uint child, float3 bmin, float3 bmax, float3 split, float3& cmin, float3& cmax) const
+	{
+		// child index bits: x = 4, y = 2, z = 1; a set bit selects the upper half
+		for (int a = 0; a < 3; a++)
 		{
-			int childIdx = nodesUsed++;
-			nodes[childIdx].leftFirst = leftFirstArray[i];
-			nodes[childIdx].triCount = leftFirstArray[i] - leftFirstArray[i - 1];
+			bool upper = (child & (4 >> a)) != 0;
+			cmin[a] = upper ? split[a] : bmin[a];
+			cmax[a] = upper ? bmax[a] : split[a];
 		}
-		node.leftFirst = firstChildIdx;
-		node.triCount = 0;
-
-		UpdateNodeBounds(firstChildIdx, node.aabbMin, splitPos);
-		UpdateNodeBounds(firstChildIdx + 1, float3(node.aabbMin[0], node.aabbMin[1], splitPos[2]), float3(splitPos[0], splitPos[1], node.aabbMax[2]));
-		UpdateNodeBounds(firstChildIdx + 2, float3(node.aabbMin[0], splitPos[1], node.aabbMin[2]), float3(splitPos[0], node.aabbMax[1], splitPos[2]));
-		UpdateNodeBounds(firstChildIdx + 3, float3(node.aabbMin[0], splitPos[1], splitPos[2]), float3(splitPos[0], node.aabbMax[1], node.aabbMax[2]));
-		UpdateNodeBounds(firstChildIdx + 4, float3(splitPos[0], node.aabbMin[1], node.aabbMin[2]), float3(node.aabbMax[0], splitPos[1], splitPos[2]));
-		UpdateNodeBounds(firstChildIdx + 5, float3(splitPos[0], node.aabbMin[1], splitPos[2]), float3(node.aabbMax[0], splitPos[1], node.aabbMax[2]));
-		UpdateNodeBounds(firstChildIdx + 6, float3(splitPos[0], splitPos[1], node.aabbMin[2]), float3(node.aabbMax[0], node.aabbMax[1], splitPos[2]));
-		UpdateNodeBounds(firstChildIdx + 7, splitPos, node.aabbMax);
+	}
 
-		for (int i = 0; i < 8; i++)
-		{
-			Subdivide(firstChildIdx + i);
-		}
+	float Octree::HalfArea(float3 bmin, float3 bmax) const
+	{
+		float3 e = bmax - bmin;
+		return e.x * e.y + e.y * e.z + e.z * e.x;
 	}
 
 	void Octree::Intersect(Ray& ray, uint nodeIdx, int* intersectionTests, int* traversalSteps)
 	{
-		Node* node = &nodes[nodeIdx], * stack[64];
+		// parametric traversal: the ray interval of a child follows from the parent's
+		// interval and the crossings of the three mid-planes, so no child boxes are
+		// tested and no sorting is needed.
+		struct StackEntry { OctreeNode* node; float tEnter, tExit; } stack[3 * OCTREE_MAX_DEPTH + 4];
+		OctreeNode* node = &octNodes[nodeIdx];
 		uint stackPtr = 0;
+		float tEnter, tExit;
 
 		(*intersectionTests)++;
 		(*traversalSteps)++;
-		if (IntersectAABB(ray, node->aabbMin, node->aabbMax) == 1e30f) return;
+		if (!IntersectInterval(ray, aabbMin, aabbMax, tEnter, tExit)) return;
 		while (1)
 		{
 			if (node->isLeaf())
 			{
 				for (uint i = 0; i < node->triCount; i++)
 				{
-					IntersectTri(ray, tri[triIdx[node->leftFirst + i]]);
+					IntersectTri(ray, triIdx[node->first + i]);
 					(*intersectionTests)++;
 				}
-				if (stackPtr == 0) break; else node = stack[--stackPtr];
-				continue;
-			}
-			Node* child[8];
-			child[0] = &nodes[node->leftFirst];
-			child[1] = &nodes[node->leftFirst + 1];
-			child[2] = &nodes[node->leftFirst + 2];
-			child[3] = &nodes[node->leftFirst + 3];
-			child[4] = &nodes[node->leftFirst + 4];
-			child[5] = &nodes[node->leftFirst + 5];
-			child[6] = &nodes[node->leftFirst + 6];
-			child[7] = &nodes[node->leftFirst + 7];
-
-			float dist[8];
-			dist[0] = IntersectAABB(ray, child[0]->aabbMin, child[0]->aabbMax);
-			dist[1] = IntersectAABB(ray, child[1]->aabbMin, child[1]->aabbMax);
-			dist[2] = IntersectAABB(ray, child[2]->aabbMin, child[2]->aabbMax);
-			dist[3] = IntersectAABB(ray, child[3]->aabbMin, child[3]->aabbMax);
-			dist[4] = IntersectAABB(ray, child[4]->aabbMin, child[4]->aabbMax);
-			dist[5] = IntersectAABB(ray, child[5]->aabbMin, child[5]->aabbMax);
-			dist[6] = IntersectAABB(ray, child[6]->aabbMin, child[6]->aabbMax);
-			dist[7] = IntersectAABB(ray, child[7]->aabbMin, child[7]->aabbMax);
-			(*intersectionTests) += 8;
-
-			for (int i = 0; i < 8; i++) for (int j = 0; j < 8; j++)
-			{
-				if (dist[i] > dist[j]) { swap(dist[i], dist[j]); swap(child[i], child[j]); }
-			}
-			
-			if (dist[0] == 1e30f)
-			{
-				if (stackPtr == 0) break; else node = stack[--stackPtr];
 			}
 			else
 			{
-				node = child[0];
-				(*traversalSteps)++;
-				if (dist[1] != 1e30f) stack[stackPtr++] = child[1];
-				if (dist[2] != 1e30f) stack[stackPtr++] = child[2];
-				if (dist[3] != 1e30f) stack[stackPtr++] = child[3];
-				if (dist[4] != 1e30f) stack[stackPtr++] = child[4];
-				if (dist[5] != 1e30f) stack[stackPtr++] = child[5];
-				if (dist[6] != 1e30f) stack[stackPtr++] = child[6];
-				if (dist[7] != 1e30f) stack[stackPtr++] = child[7];
-
+				float3 split = node->split;
+				float3 tMid = (split - ray.O) * ray.rD;
+				(*intersectionTests)++;
+				// octant of the entry point; child index bits are x = 4, y = 2, z = 1
+				uint child = 0;
+				for (int a = 0; a < 3; a++)
+				{
+					bool upper;
+					if (ray.D[a] == 0) upper = ray.O[a] >= split[a], tMid[a] = 1e30f;
+					else if (tMid[a] > tEnter) upper = ray.O[a] >= split[a];
+					else upper = ray.D[a] > 0;
+					if (upper) child |= 4 >> a;
+				}
+				// order the three plane crossings along the ray
+				int a0 = 0, a1 = 1, a2 = 2;
+				if (tMid[a0] > tMid[a1]) swap(a0, a1);
+				if (tMid[a1] > tMid[a2]) swap(a1, a2);
+				if (tMid[a0] > tMid[a1]) swap(a0, a1);
+				const int axisOrder[3] = { a0, a1, a2 };
+				// every crossing inside the interval flips one bit: at most four children
+				uint visit[4];
+				float tSplit[5];
+				int visitCount = 1;
+				visit[0] = child, tSplit[0] = tEnter;
+				for (int i = 0; i < 3; i++)
+				{
+					int a = axisOrder[i];
+					if (!(tMid[a] > tEnter && tMid[a] < tExit)) continue;
+					child ^= 4 >> a;
+					tSplit[visitCount] = tMid[a];
+					visit[visitCount++] = child;
+				}
+				tSplit[visitCount] = tExit;
+				// push far to near, so the nearest child is popped first; empty
+				// octants are skipped on the mask alone, without touching memory
+				const uint mask = node->childMask;
+				for (int i = visitCount - 1; i >= 0; i--) if (mask & (1 << visit[i]))
+				{
+					OctreeNode* c = &octNodes[node->first + _mm_popcnt_u32(mask & ((1 << visit[i]) - 1))];
+					stack[stackPtr++] = { c, tSplit[i], tSplit[i + 1] };
+				}
 			}
+			// skip children that start beyond the nearest hit found so far
+			do
+			{
+				if (stackPtr == 0) return;
+				stackPtr--;
+			} while (stack[stackPtr].tEnter > ray.t);
+			node = stack[stackPtr].node;
+			tEnter = stack[stackPtr].tEnter, tExit = stack[stackPtr].tExit;
+			(*traversalSteps)++;
 		}
-
 	}
 
-	void Octree::ArrangeTriangles(const Node& node, float3 splitPos, int (&leftFirstArray)[9], uint octant)
+	void Octree::Serialize(AccelArchive& ar)
 	{
-		int i = leftFirstArray[0];
-		int j = i + node.triCount - 1;
-		while (i <= j)
-		{
-			Tri& t = tri[triIdx[i]];
-			switch (octant)
-			{
-			case 1:
-				if (t.centroid[0] < splitPos[0] && t.centroid[1] < splitPos[1] && t.centroid[2] < splitPos[2]) goto Add;
-			case 2:
-				if (t.centroid[0] < splitPos[0] && t.centroid[1] < splitPos[1] && t.centroid[2] >= splitPos[2]) goto Add;
-			case 3:
-				if (t.centroid[0] < splitPos[0] && t.centroid[1] >= splitPos[1] && t.centroid[2] < splitPos[2]) goto Add;
-			case 4:
-				if (t.centroid[0] < splitPos[0] && t.centroid[1] >= splitPos[1] && t.centroid[2] >= splitPos[2]) goto Add;
-			case 5:
-				if (t.centroid[0] >= splitPos[0] && t.centroid[1] < splitPos[1] && t.centroid[2] < splitPos[2]) goto Add;
-			case 6:
-				if (t.centroid[0] >= splitPos[0] && t.centroid[1] < splitPos[1] && t.centroid[2] >= splitPos[2]) goto Add;
-			case 7:
-				if (t.centroid[0] >= splitPos[0] && t.centroid[1] >= splitPos[1] && t.centroid[2] < splitPos[2]) goto Add;
-			case 8:
-				if (t.centroid[0] >= splitPos[0] && t.centroid[1] >= splitPos[1] && t.centroid[2] >= splitPos[2]) goto Add;
-			default:
-				return;
-			}
-			swap(triIdx[i], triIdx[j--]);
-			continue;
-		Add:
-			++i;
-			++leftFirstArray[octant];
-		}
+		ar.Check(OCTREE_MAX_DEPTH), ar.Check(OCTREE_LEAF_SIZE), ar.Check(OCTREE_BINS), ar.Check(OCTREE_C_TRAV);
+#ifdef OCTREE_SAH_SPLIT
+		ar.Check(true);
+#else
+		ar.Check(false);
+#endif
+		ar.Check((uint)sizeof(OctreeNode));
+		ar.Value(aabbMin), ar.Value(aabbMax);
+		ar.Value(nodesUsed), ar.Value(refCount), ar.Value(maxDepth);
+		ar.Array(octNodes, nodesUsed);
+		ar.Array(triIdx, refCount);
 	}
 
-	void Octree::UpdateNodeBounds(uint nodeIdx, const float3& min, const float3& max)
+	void Octree::Free()
 	{
-		Node& node = nodes[nodeIdx];
-		node.aabbMin = min;
-		node.aabbMax = max;
+		delete[] octNodes;
+		octNodes = 0;
+		Accel::Free();
 	}
+
+	OctreeNode* octNodes = 0;
+	float3 aabbMin, aabbMax;
+	uint refCount = 0, maxDepth = 0;
 };
 }
\ No newline at end of file
@@ -0,0 +1,363 @@
+#pragma once
+#include "bvh.h"
+#include "mappedfile.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define PAGE_TRIS		512			// a subtree with at most this many triangles becomes one page
+#define PAGE_BUDGET		(8 << 20)	// bytes of resident pages, split evenly over the render threads
+#define PAGE_NODE		0xffffffff	// triCount of a resident node whose subtree lives in page leftFirst
+
+namespace Tmpl8 {
+
+// triangle as stored in a page: positions inline, so a page needs no other geometry.
+// The page's vertex normals follow its triangles, three per triangle, for shading.
+struct PagedTri
+{
+	float3 v0, v1, v2;
+};
+
+// location of one page in the page file: nodeCount subtree nodes, then triCount
+// PagedTris, then 3 * triCount normals. Pages are stored in triangle order; hits
+// report firstTri + the triangle's position in the page as their primIdx.
+struct PageInfo
+{
+	uint64_t offset;
+	uint nodeCount, triCount, firstTri;
+	size_t Size() const { return TraversalSize() + triCount * 3 * sizeof(float3); }
+	size_t TraversalSize() const { return nodeCount * sizeof(Node) + triCount * sizeof(PagedTri); }	// what the caches copy
+};
+
+// end of the page file: where the resident part is
+struct PageFileTail
+{
+	uint64_t topOffset;				// topCount Nodes, then pageCount PageInfos
+	uint topCount, pageCount;
+};
+
+// least recently used page cache of one render thread; threads don't share
+// pages, so lookups and evictions need no locking
+__declspec(align(64)) struct PageCache
+{
+	list<uint> lru;							// resident pages, most recently used first
+	vector<list<uint>::iterator> where;		// per page: its lru entry, if resident
+	vector<char*> resident;					// per page: its copy, or 0
+	size_t used = 0;
+	uint64_t hits = 0, misses = 0;
+	float stallTime = 0;					// seconds spent paging in
+};
+
+// -----------------------------------------------------------
+// Out-of-core BVH: the top levels stay resident; every subtree
+// of at most PAGE_TRIS triangles is written, with its nodes,
+// vertex positions and normals, to a page file that is memory
+// mapped and paged in on demand into per-thread LRU caches of
+// limited size. The page file is an AccelCache file of type
+// "pages": it is built once from an in-core BVH and reused as
+// long as the geometry doesn't change. Holds no mesh: once the
+// pages exist, the BVH and the mesh can be released.
+// -----------------------------------------------------------
+class PagedBVH : public Accel
+{
+public:
+	PagedBVH() = default;
+
+	// map an existing page file that matches the geometry
+	bool PagedBVH::Load(const string& asset, uint64_t meshHash)
+	{
+		Timer t;
+		Free();
+		const string file = AccelCache::FileName(asset, meshHash, "pages");
+		if (!mapping.Open(file.c_str())) return false;
+		if (!AccelCache::Check(mapping, "pages", meshHash, file) || mapping.size < sizeof(AccelCacheHeader) + sizeof(PageFileTail))
+		{
+			mapping.Close();
+			return false;
+		}
+		const PageFileTail& tail = *(const PageFileTail*)(mapping.data + mapping.size - sizeof(PageFileTail));
+		if (tail.topOffset + tail.topCount * sizeof(Node) + tail.pageCount * sizeof(PageInfo) + sizeof(PageFileTail) != mapping.size)
+		{
+			printf("Cache: %s is stale, rebuilding\n", file.c_str());
+			mapping.Close();
+			return false;
+		}
+		const Node* top = (const Node*)(mapping.data + tail.topOffset);
+		const PageInfo* info = (const PageInfo*)(top + tail.topCount);
+		topNodes.assign(top, top + tail.topCount);
+		pages.assign(info, info + tail.pageCount);
+		fileSize = mapping.size;
+		InitCaches();
+		printf("Cache: %s mapped in %.1f ms (%i resident nodes, %i pages)\n", file.c_str(), t.elapsed() * 1000, (int)topNodes.size(), (int)pages.size());
+		return true;
+	}
+
+	// write the page file of an in-core BVH, and map it; false when the file can't be written
+	bool PagedBVH::Build(const BVH& bvh, const string& asset, uint64_t meshHash)
+	{
+		Timer t;
+		Free();
+		objIdx = bvh.objIdx;
+		const string file = AccelCache::FileName(asset, meshHash, "pages");
+		FILE* f = fopen(file.c_str(), "wb");
+		if (!f) return false;
+		// the header is final once the size is known
+		AccelCacheHeader h = {};
+		fwrite(&h, sizeof(h), 1, f);
+		topNodes.assign(1, bvh.nodes[bvh.rootNodeIdx]);
+		fileSize = sizeof(h), triTotal = 0;
+		Split(bvh, bvh.rootNodeIdx, 0, f);
+		PageFileTail tail = { fileSize, (uint)topNodes.size(), (uint)pages.size() };
+		fwrite(topNodes.data(), sizeof(Node), topNodes.size(), f);
+		fwrite(pages.data(), sizeof(PageInfo), pages.size(), f);
+		fwrite(&tail, sizeof(tail), 1, f);
+		fileSize += topNodes.size() * sizeof(Node) + pages.size() * sizeof(PageInfo) + sizeof(tail);
+		memcpy(h.magic, "ACCL", 4);
+		h.version = ACCEL_CACHE_VERSION;
+		strncpy(h.type, "pages", sizeof(h.type));
+		h.meshHash = meshHash;
+		h.size = fileSize - sizeof(h);
+		fseek(f, 0, SEEK_SET);
+		fwrite(&h, sizeof(h), 1, f);
+		const bool written = !ferror(f);
+		fclose(f);
+		if (!written || !mapping.Open(file.c_str())) { topNodes.clear(), pages.clear(); return false; }
+		InitCaches();
+		printf("Paged BVH: %i resident nodes, %i pages, %.1f KB paged out, built in %.1f ms\n",
+			(int)topNodes.size(), (int)pages.size(), fileSize / 1024.0f, t.elapsed() * 1000);
+		return true;
+	}
+
+	void PagedBVH::InitCaches()
+	{
+#ifdef _OPENMP
+		caches.resize(omp_get_max_threads());
+#else
+		caches.resize(1);
+#endif
+		for (PageCache& c : caches) c.where.resize(pages.size()), c.resident.assign(pages.size(), 0);
+		budget = PAGE_BUDGET / caches.size();
+	}
+
+	// copy the top levels; small subtrees go to the page file
+	void PagedBVH::Split(const BVH& bvh, uint nodeIdx, uint topIdx, FILE* f)
+	{
+		const Node& node = bvh.nodes[nodeIdx];
+		uint first, count;
+		Span(bvh, nodeIdx, first, count);
+		if (node.triCount > 0 || count <= PAGE_TRIS)
+		{
+			topNodes[topIdx].leftFirst = WritePage(bvh, nodeIdx, first, count, f);
+			topNodes[topIdx].triCount = PAGE_NODE;
+			return;
+		}
+		const uint childIdx = (uint)topNodes.size();
+		topNodes.push_back(bvh.nodes[node.leftFirst]);
+		topNodes.push_back(bvh.nodes[node.leftFirst + 1]);
+		topNodes[topIdx].leftFirst = childIdx;
+		Split(bvh, node.leftFirst, childIdx, f);
+		Split(bvh, node.leftFirst + 1, childIdx + 1, f);
+	}
+
+	// triangles of a BVH subtree are one contiguous range of triIdx
+	void PagedBVH::Span(const BVH& bvh, uint nodeIdx, uint& first, uint& count) const
+	{
+		const Node& node = bvh.nodes[nodeIdx];
+		if (node.triCount > 0) { first = node.leftFirst, count = node.triCount; return; }
+		uint first2, count2;
+		Span(bvh, node.leftFirst, first, count);
+		Span(bvh, node.leftFirst + 1, first2, count2);
+		first = min(first, first2), count += count2;
+	}
+
+	uint PagedBVH::WritePage(const BVH& bvh, uint rootIdx, uint first, uint count, FILE* f)
+	{
+		// breadth-first copy, so siblings stay adjacent; leaves are rebased to the page
+		vector<Node> local(1, bvh.nodes[rootIdx]);
+		for (uint i = 0; i < local.size(); i++)
+		{
+			if (local[i].triCount > 0) { local[i].leftFirst -= first; continue; }
+			const uint child = local[i].leftFirst;
+			local[i].leftFirst = (uint)local.size();
+			local.push_back(bvh.nodes[child]);
+			local.push_back(bvh.nodes[child + 1]);
+		}
+		vector<PagedTri> tris(count);
+		vector<float3> normals(count * 3);
+		for (uint i = 0; i < count; i++)
+		{
+			const uint idx = bvh.triIdx[first + i];
+			const Tri& t = bvh.tri[idx];
+			const TriNormals& n = bvh.triNormals[idx];
+			tris[i].v0 = bvh.Vertex(t.vertexIdx0), tris[i].v1 = bvh.Vertex(t.vertexIdx1), tris[i].v2 = bvh.Vertex(t.vertexIdx2);
+			normals[i * 3 + 0] = bvh.Normal(n.normalIdx0), normals[i * 3 + 1] = bvh.Normal(n.normalIdx1), normals[i * 3 + 2] = bvh.Normal(n.normalIdx2);
+		}
+		PageInfo page = { fileSize, (uint)local.size(), count, triTotal };
+		fwrite(local.data(), sizeof(Node), local.size(), f);
+		fwrite(tris.data(), sizeof(PagedTri), count, f);
+		fwrite(normals.data(), sizeof(float3), count * 3, f);
+		fileSize += page.Size(), triTotal += count;
+		pages.push_back(page);
+		return (uint)pages.size() - 1;
+	}
+
+	// resident copy of a page; loads it, evicting the least recently used pages
+	// when the budget is exhausted. Only valid until this thread's next Fetch.
+	const char* PagedBVH::Fetch(uint pageIdx)
+	{
+#ifdef _OPENMP
+		PageCache& c = caches[omp_get_thread_num()];
+#else
+		PageCache& c = caches[0];
+#endif
+		if (c.resident[pageIdx])
+		{
+			c.hits++;
+			c.lru.splice(c.lru.begin(), c.lru, c.where[pageIdx]);
+			return c.resident[pageIdx];
+		}
+		Timer t;
+		const PageInfo& page = pages[pageIdx];
+		const size_t size = page.TraversalSize();
+		while (c.used + size > budget && !c.lru.empty())
+		{
+			const uint victim = c.lru.back();
+			c.lru.pop_back();
+			delete[] c.resident[victim];
+			c.resident[victim] = 0;
+			c.used -= pages[victim].TraversalSize();
+		}
+		char* data = new char[size];
+		memcpy(data, mapping.data + page.offset, size);
+		c.lru.push_front(pageIdx);
+		c.where[pageIdx] = c.lru.begin();
+		c.resident[pageIdx] = data;
+		c.used += size;
+		c.misses++;
+		c.stallTime += t.elapsed();
+		return data;
+	}
+
+	void PagedBVH::Intersect(Ray& ray, uint nodeIdx, int* intersectionTests, int* traversalSteps)
+	{
+		if (topNodes.empty()) return;
+		Node* node = &topNodes[nodeIdx], * stack[64];
+		uint stackPtr = 0;
+
+		(*intersectionTests)++;
+		(*traversalSteps)++;
+		if (IntersectAABB(ray, node->aabbMin, node->aabbMax) == 1e30f) return;
+		while (1)
+		{
+			if (node->isLeaf())
+			{
+				IntersectPage(ray, node->leftFirst, intersectionTests, traversalSteps);
+				if (stackPtr == 0) break; else node = stack[--stackPtr];
+				continue;
+			}
+			Node* child1 = &topNodes[node->leftFirst];
+			Node* child2 = &topNodes[node->leftFirst + 1];
+			float dist1 = IntersectAABB(ray, child1->aabbMin, child1->aabbMax);
+			float dist2 = IntersectAABB(ray, child2->aabbMin, child2->aabbMax);
+			(*intersectionTests) += 2;
+			if (dist1 > dist2) { swap(dist1, dist2); swap(child1, child2); }
+			if (dist1 == 1e30f)
+			{
+				if (stackPtr == 0) break; else node = stack[--stackPtr];
+			}
+			else
+			{
+				node = child1;
+				(*traversalSteps)++;
+				if (dist2 != 1e30f) stack[stackPtr++] = child2;
+			}
+		}
+	}
+
+	// the subtree in a page; its root was already tested against the ray
+	void PagedBVH::IntersectPage(Ray& ray, uint pageIdx, int* intersectionTests, int* traversalSteps)
+	{
+		const char* data = Fetch(pageIdx);
+		Node* pageNodes = (Node*)data;
+		const PageInfo& page = pages[pageIdx];
+		const PagedTri* tris = (const PagedTri*)(data + page.nodeCount * sizeof(Node));
+		Node* node = pageNodes, * stack[64];
+		uint stackPtr = 0;
+		while (1)
+		{
+			if (node->isLeaf())
+			{
+				for (uint i = 0; i < node->triCount; i++)
+				{
+					const PagedTri& t = tris[node->leftFirst + i];
+					IntersectTri(ray, t.v0, t.v1, t.v2, page.firstTri + node->leftFirst + i, objIdx);
+					(*intersectionTests)++;
+				}
+				if (stackPtr == 0) break; else node = stack[--stackPtr];
+				continue;
+			}
+			Node* child1 = &pageNodes[node->leftFirst];
+			Node* child2 = &pageNodes[node->leftFirst + 1];
+			float dist1 = IntersectAABB(ray, child1->aabbMin, child1->aabbMax);
+			float dist2 = IntersectAABB(ray, child2->aabbMin, child2->aabbMax);
+			(*intersectionTests) += 2;
+			if (dist1 > dist2) { swap(dist1, dist2); swap(child1, child2); }
+			if (dist1 == 1e30f)
+			{
+				if (stackPtr == 0) break; else node = stack[--stackPtr];
+			}
+			else
+			{
+				node = child1;
+				(*traversalSteps)++;
+				if (dist2 != 1e30f) stack[stackPtr++] = child2;
+			}
+		}
+	}
+
+	// paging statistics over all threads since the last report
+	void PagedBVH::Report()
+	{
+		uint64_t hits = 0, misses = 0;
+		float stallTime = 0;
+		size_t used = 0;
+		for (PageCache& c : caches)
+		{
+			hits += c.hits, misses += c.misses, stallTime += c.stallTime, used += c.used;
+			c.hits = c.misses = 0, c.stallTime = 0;
+		}
+		if (hits + misses == 0) return;
+		printf("Paged BVH: %.2f%% page hits, %llu misses, %.1f ms stalled, %.1f of %.1f MB resident\n",
+			100.0 * hits / (hits + misses), (unsigned long long)misses, stallTime * 1000,
+			used / 1048576.0f, PAGE_BUDGET / 1048576.0f);
+	}
+
+	// vertex normals of a hit, read from the mapping: shading touches one triangle
+	// per ray, so it doesn't go through the page caches
+	float3 PagedBVH::GetNormal(uint primIdx, float u, float v) const
+	{
+		const PageInfo& page = *(upper_bound(pages.begin(), pages.end(), primIdx,
+			[](uint idx, const PageInfo& p) { return idx < p.firstTri; }) - 1);
+		const float3* n = (const float3*)(mapping.data + page.offset + page.TraversalSize()) + (primIdx - page.firstTri) * 3;
+		return normalize(n[0] * (1 - u - v) + n[1] * u + n[2] * v);
+	}
+
+	void PagedBVH::Free()
+	{
+		for (PageCache& c : caches) for (char* data : c.resident) delete[] data;
+		caches.clear();
+		topNodes.clear(), pages.clear();
+		mapping.Close();
+		Accel::Free();
+	}
+
+	vector<Node> topNodes;			// resident; leaves have triCount PAGE_NODE
+	vector<PageInfo> pages;
+	vector<PageCache> caches;		// one per render thread
+	MappedFile mapping;				// the page file
+	uint64_t fileSize = 0;
+	uint triTotal = 0;				// build only: triangles written so far
+	size_t budget = PAGE_BUDGET;	// per thread
+};
+
+}
@@ -0,0 +1,358 @@
+#pragma once
+#include "objects.h"
+
+#define PRIMBVH_BINS		8		// split plane candidates per axis
+#define PRIMBVH_LEAF_SIZE	2		// nodes with this many primitives or fewer always become leaves
+
+namespace Tmpl8 {
+
+// primitive reference: which array, which element, and its world space bounds
+struct PrimRef
+{
+	enum { SPHERE = 0, CUBE, TORUS, QUAD };
+	float3 aabbMin, aabbMax, centroid;
+	uint type, idx;
+};
+
+// -----------------------------------------------------------
+// BVH over analytic primitives. Every primitive type keeps its
+// own array and its own intersection code; the BVH only stores
+// references with bounds. Planes are infinite and can't be
+// bounded, so they are tested for every ray.
+// -----------------------------------------------------------
+class PrimitiveBVH
+{
+public:
+	PrimitiveBVH() = default;
+	void Add(const Sphere& s) { spheres.push_back(s); }
+	void Add(const Cube& c) { cubes.push_back(c); }
+	void Add(const Torus& t) { tori.push_back(t); }
+	void Add(const Quad& q) { quads.push_back(q); }
+	void Add(const Plane& p) { planes.push_back(p); }
+
+	void Build()
+	{
+		Timer t;
+		// collect references with their bounds
+		refs.clear();
+		for (uint i = 0; i < (uint)spheres.size(); i++) AddRef(PrimRef::SPHERE, i);
+		for (uint i = 0; i < (uint)cubes.size(); i++) AddRef(PrimRef::CUBE, i);
+		for (uint i = 0; i < (uint)tori.size(); i++) AddRef(PrimRef::TORUS, i);
+		for (uint i = 0; i < (uint)quads.size(); i++) AddRef(PrimRef::QUAD, i);
+		primCount = (uint)refs.size();
+		// build
+		delete[] nodes;
+		nodes = new Node[max(primCount * 2, 2u)];
+		nodesUsed = 1;
+		Node& root = nodes[0];
+		root.leftFirst = 0, root.triCount = primCount;
+		UpdateNodeBounds(0);
+		if (primCount) Subdivide(0);
+		// objIdx lookup table for GetNormal / GetAlbedo; Subdivide reordered refs, so only now
+		int maxObjIdx = -1;
+		for (const PrimRef& r : refs) maxObjIdx = max(maxObjIdx, GetObjIdx(r));
+		for (const Plane& p : planes) maxObjIdx = max(maxObjIdx, p.objIdx);
+		objRef.assign(maxObjIdx + 1, -1);
+		for (uint i = 0; i < primCount; i++) objRef[GetObjIdx(refs[i])] = i;
+		for (uint i = 0; i < (uint)planes.size(); i++) objRef[planes[i].objIdx] = primCount + i;
+		printf("PrimitiveBVH: %u primitives (+%u planes), %u nodes, built in %.1f ms\n",
+			primCount, (uint)planes.size(), nodesUsed, t.elapsed() * 1000);
+		const uint bad = Validate();
+		if (bad) printf("PrimitiveBVH: %u primitives shaded as another object\n", bad);
+	}
+
+	// shade a known hit on every primitive: a ray from outside its bounds towards
+	// its center, intersected with that primitive only, must get the primitive's own
+	// normal back through the objIdx lookup. Returns the number of mismatches.
+	uint Validate() const
+	{
+		uint bad = 0;
+		for (const PrimRef& ref : refs)
+		{
+			const float3 O = ref.centroid + (ref.aabbMax - ref.aabbMin) + float3(0.01f, 0.02f, 0.03f);
+			Ray ray(O, normalize(ref.centroid - O));
+			IntersectPrim(ray, ref);
+			if (ray.objIdx == -1) continue; // e.g. through the hole of a torus
+			const float3 I = ray.O + ray.t * ray.D;
+			float3 N;
+			if (ref.type == PrimRef::SPHERE) N = spheres[ref.idx].GetNormal(I);
+			else if (ref.type == PrimRef::CUBE) N = cubes[ref.idx].GetNormal(I);
+			else if (ref.type == PrimRef::TORUS) N = tori[ref.idx].GetNormal(I);
+			else N = quads[ref.idx].GetNormal(I);
+			if (ray.objIdx != GetObjIdx(ref) || length(GetNormal(ray.objIdx, I) - N) > 1e-5f) bad++;
+		}
+		return bad;
+	}
+
+	void Intersect(Ray& ray, int* intersectionTests, int* traversalSteps) const
+	{
+		for (const Plane& p : planes) p.Intersect(ray);
+		(*intersectionTests) += (int)planes.size();
+		if (primCount == 0) return;
+		const Node* node = &nodes[0], * stack[64];
+		uint stackPtr = 0;
+
+		(*intersectionTests)++;
+		(*traversalSteps)++;
+		if (IntersectAABB(ray, node->aabbMin, node->aabbMax) == 1e30f) return;
+		while (1)
+		{
+			if (node->triCount > 0)
+			{
+				for (uint i = 0; i < node->triCount; i++) IntersectPrim(ray, refs[node->leftFirst + i]);
+				(*intersectionTests) += node->triCount;
+				if (stackPtr == 0) break; else node = stack[--stackPtr];
+				continue;
+			}
+			const Node* child1 = &nodes[node->leftFirst];
+			const Node* child2 = &nodes[node->leftFirst + 1];
+			float dist1 = IntersectAABB(ray, child1->aabbMin, child1->aabbMax);
+			float dist2 = IntersectAABB(ray, child2->aabbMin, child2->aabbMax);
+			(*intersectionTests) += 2;
+			if (dist1 > dist2) { swap(dist1, dist2); swap(child1, child2); }
+			if (dist1 == 1e30f)
+			{
+				if (stackPtr == 0) break; else node = stack[--stackPtr];
+			}
+			else
+			{
+				node = child1;
+				(*traversalSteps)++;
+				if (dist2 != 1e30f) stack[stackPtr++] = child2;
+			}
+		}
+	}
+
+	// reference path without the BVH, for comparison
+	void IntersectAll(Ray& ray, int* intersectionTests) const
+	{
+		for (const Plane& p : planes) p.Intersect(ray);
+		for (uint i = 0; i < primCount; i++) IntersectPrim(ray, refs[i]);
+		(*intersectionTests) += (int)planes.size() + primCount;
+	}
+
+	bool IsOccluded(const Ray& ray) const
+	{
+		// any hit will do; planes are skipped, like in the scene
+		if (primCount == 0) return false;
+		const Node* node = &nodes[0], * stack[64];
+		uint stackPtr = 0;
+		while (1)
+		{
+			if (IntersectAABB(ray, node->aabbMin, node->aabbMax) != 1e30f)
+			{
+				if (node->triCount == 0)
+				{
+					stack[stackPtr++] = &nodes[node->leftFirst + 1];
+					node = &nodes[node->leftFirst];
+					continue;
+				}
+				for (uint i = 0; i < node->triCount; i++) if (IsOccludedPrim(ray, refs[node->leftFirst + i])) return true;
+			}
+			if (stackPtr == 0) return false; else node = stack[--stackPtr];
+		}
+	}
+
+	bool Contains(int objIdx) const { return objIdx >= 0 && objIdx < (int)objRef.size() && objRef[objIdx] >= 0; }
+
+	float3 GetNormal(int objIdx, const float3 I) const
+	{
+		const uint r = objRef[objIdx];
+		if (r >= primCount) return planes[r - primCount].GetNormal(I);
+		const PrimRef& ref = refs[r];
+		if (ref.type == PrimRef::SPHERE) return spheres[ref.idx].GetNormal(I);
+		if (ref.type == PrimRef::CUBE) return cubes[ref.idx].GetNormal(I);
+		if (ref.type == PrimRef::TORUS) return tori[ref.idx].GetNormal(I);
+		return quads[ref.idx].GetNormal(I);
+	}
+
+	float3 GetAlbedo(int objIdx, const float3 I) const
+	{
+		const uint r = objRef[objIdx];
+		if (r >= primCount) return planes[r - primCount].GetAlbedo(I);
+		const PrimRef& ref = refs[r];
+		if (ref.type == PrimRef::SPHERE) return spheres[ref.idx].GetAlbedo(I);
+		if (ref.type == PrimRef::CUBE) return cubes[ref.idx].GetAlbedo(I);
+		if (ref.type == PrimRef::TORUS) return tori[ref.idx].GetAlbedo(I);
+		return quads[ref.idx].GetAlbedo(I);
+	}
+
+	void IntersectPrim(Ray& ray, const PrimRef& ref) const
+	{
+		if (ref.type == PrimRef::SPHERE) spheres[ref.idx].Intersect(ray);
+		else if (ref.type == PrimRef::CUBE) cubes[ref.idx].Intersect(ray);
+		else if (ref.type == PrimRef::TORUS) tori[ref.idx].Intersect(ray);
+		else quads[ref.idx].Intersect(ray);
+	}
+
+	bool IsOccludedPrim(const Ray& ray, const PrimRef& ref) const
+	{
+		if (ref.type == PrimRef::SPHERE) return spheres[ref.idx].IsOccluded(ray);
+		if (ref.type == PrimRef::CUBE) return cubes[ref.idx].IsOccluded(ray);
+		if (ref.type == PrimRef::TORUS) return tori[ref.idx].IsOccluded(ray);
+		return quads[ref.idx].IsOccluded(ray);
+	}
+
+	int GetObjIdx(const PrimRef& ref) const
+	{
+		if (ref.type == PrimRef::SPHERE) return spheres[ref.idx].objIdx;
+		if (ref.type == PrimRef::CUBE) return cubes[ref.idx].objIdx;
+		if (ref.type == PrimRef::TORUS) return tori[ref.idx].objIdx;
+		return quads[ref.idx].objIdx;
+	}
+
+	void AddRef(uint type, uint idx)
+	{
+		PrimRef r;
+		r.type = type, r.idx = idx;
+		r.aabbMin = float3(1e30f), r.aabbMax = float3(-1e30f);
+		if (type == PrimRef::SPHERE)
+		{
+			const Sphere& s = spheres[idx];
+			float radius = 1 / s.invr;
+			r.aabbMin = s.pos - radius, r.aabbMax = s.pos + radius;
+		}
+		else
+		{
+			// transformed corners of the object space box
+			float3 bmin, bmax;
+			mat4 M;
+			if (type == PrimRef::CUBE)
+			{
+				const Cube& c = cubes[idx];
+				bmin = float3(c.b[0].x, c.b[0].y, c.b[0].z), bmax = float3(c.b[1].x, c.b[1].y, c.b[1].z), M = c.M;
+			}
+			else if (type == PrimRef::TORUS)
+			{
+				// the torus lies in the xy-plane of its object space
+				const Torus& t = tori[idx];
+				float a = sqrtf(t.rc2), b = sqrtf(t.rt2);
+				bmin = float3(-a - b, -a - b, -b), bmax = float3(a + b, a + b, b), M = t.T;
+			}
+			else
+			{
+				// the quad lies in the xz-plane of its object space
+				const Quad& q = quads[idx];
+				bmin = float3(-q.size, 0, -q.size), bmax = float3(q.size, 0, q.size), M = q.T;
+			}
+			for (int i = 0; i < 8; i++)
+			{
+				float3 corner((i & 4) ? bmax.x : bmin.x, (i & 2) ? bmax.y : bmin.y, (i & 1) ? bmax.z : bmin.z);
+				float3 P = TransformPosition(corner, M);
+				r.aabbMin = fminf(r.aabbMin, P), r.aabbMax = fmaxf(r.aabbMax, P);
+			}
+			// flat primitives get a little thickness, so the slab test stays robust
+			r.aabbMin -= 1e-4f, r.aabbMax += 1e-4f;
+		}
+		r.centroid = (r.aabbMin + r.aabbMax) * 0.5f;
+		refs.push_back(r);
+	}
+
+	float IntersectAABB(const Ray& ray, const float3 bmin, const float3 bmax) const
+	{
+		float tx1 = (bmin.x - ray.O.x) * ray.rD.x, tx2 = (bmax.x - ray.O.x) * ray.rD.x;
+		float tmin = min(tx1, tx2), tmax = max(tx1, tx2);
+		float ty1 = (bmin.y - ray.O.y) * ray.rD.y, ty2 = (bmax.y - ray.O.y) * ray.rD.y;
+		tmin = max(tmin, min(ty1, ty2)), tmax = min(tmax, max(ty1, ty2));
+		float tz1 = (bmin.z - ray.O.z) * ray.rD.z, tz2 = (bmax.z - ray.O.z) * ray.rD.z;
+		tmin = max(tmin, min(tz1, tz2)), tmax = min(tmax, max(tz1, tz2));
+		if (tmax >= tmin && tmin < ray.t && tmax > 0) return tmin;
+		else return 1e30f;
+	}
+
+	void Subdivide(uint nodeIdx)
+	{
+		Node& node = nodes[nodeIdx];
+		if (node.triCount <= PRIMBVH_LEAF_SIZE) return;
+		// binned SAH over the reference centroids
+		float3 cmin = float3(1e30f), cmax = float3(-1e30f);
+		for (uint i = 0; i < node.triCount; i++)
+			cmin = fminf(cmin, refs[node.leftFirst + i].centroid), cmax = fmaxf(cmax, refs[node.leftFirst + i].centroid);
+		int bestAxis = -1;
+		float bestPos = 0, bestCost = 1e30f;
+		for (int a = 0; a < 3; a++)
+		{
+			if (cmax[a] == cmin[a]) continue;
+			float3 binMin[PRIMBVH_BINS], binMax[PRIMBVH_BINS];
+			uint binCount[PRIMBVH_BINS] = { 0 };
+			for (int b = 0; b < PRIMBVH_BINS; b++) binMin[b] = float3(1e30f), binMax[b] = float3(-1e30f);
+			float scale = PRIMBVH_BINS / (cmax[a] - cmin[a]);
+			for (uint i = 0; i < node.triCount; i++)
+			{
+				const PrimRef& r = refs[node.leftFirst + i];
+				int b = min(PRIMBVH_BINS - 1, (int)((r.centroid[a] - cmin[a]) * scale));
+				binCount[b]++;
+				binMin[b] = fminf(binMin[b], r.aabbMin), binMax[b] = fmaxf(binMax[b], r.aabbMax);
+			}
+			// sweep from the right, then evaluate every plane from the left
+			float rightArea[PRIMBVH_BINS];
+			float3 bmin = float3(1e30f), bmax = float3(-1e30f);
+			for (int b = PRIMBVH_BINS - 1; b > 0; b--)
+			{
+				bmin = fminf(bmin, binMin[b]), bmax = fmaxf(bmax, binMax[b]);
+				rightArea[b] = HalfArea(bmin, bmax);
+			}
+			bmin = float3(1e30f), bmax = float3(-1e30f);
+			uint leftCount = 0;
+			for (int b = 1; b < PRIMBVH_BINS; b++)
+			{
+				bmin = fminf(bmin, binMin[b - 1]), bmax = fmaxf(bmax, binMax[b - 1]);
+				leftCount += binCount[b - 1];
+				uint rightCount = node.triCount - leftCount;
+				if (leftCount == 0 || rightCount == 0) continue;
+				float cost = leftCount * HalfArea(bmin, bmax) + rightCount * rightArea[b];
+				if (cost < bestCost) bestCost = cost, bestAxis = a, bestPos = cmin[a] + b / scale;
+			}
+		}
+		if (bestAxis == -1 || bestCost >= node.triCount * HalfArea(node.aabbMin, node.aabbMax)) return;
+		// in-place partition
+		PrimRef* first = refs.data() + node.leftFirst, * last = first + node.triCount;
+		PrimRef* mid = partition(first, last, [&](const PrimRef& r) { return r.centroid[bestAxis] < bestPos; });
+		uint leftCount = (uint)(mid - first);
+		if (leftCount == 0 || leftCount == node.triCount) return;
+		// create child nodes
+		int leftChildIdx = nodesUsed++;
+		int rightChildIdx = nodesUsed++;
+		nodes[leftChildIdx].leftFirst = node.leftFirst;
+		nodes[leftChildIdx].triCount = leftCount;
+		nodes[rightChildIdx].leftFirst = node.leftFirst + leftCount;
+		nodes[rightChildIdx].triCount = node.triCount - leftCount;
+		node.leftFirst = leftChildIdx;
+		node.triCount = 0;
+		UpdateNodeBounds(leftChildIdx);
+		UpdateNodeBounds(rightChildIdx);
+		// recurse
+		Subdivide(leftChildIdx);
+		Subdivide(rightChildIdx);
+	}
+
+	void UpdateNodeBounds(uint nodeIdx)
+	{
+		Node& node = nodes[nodeIdx];
+		node.aabbMin = float3(1e30f);
+		node.aabbMax = float3(-1e30f);
+		for (uint i = 0; i < node.triCount; i++)
+		{
+			node.aabbMin = fminf(node.aabbMin, refs[node.leftFirst + i].aabbMin);
+			node.aabbMax = fmaxf(node.aabbMax, refs[node.leftFirst + i].aabbMax);
+		}
+	}
+
+	float HalfArea(float3 bmin, float3 bmax) const
+	{
+		float3 e = bmax - bmin;
+		return e.x * e.y + e.y * e.z + e.z * e.x;
+	}
+
+	vector<Sphere> spheres;
+	vector<Cube> cubes;
+	vector<Torus> tori;
+	vector<Quad> quads;
+	vector<Plane> planes;
+	vector<PrimRef> refs;		// reordered by the build; leaves index this directly
+	vector<int> objRef;			// objIdx -> reference index; planes follow the references
+	Node* nodes = 0;			// leaves use triCount for their primitive count
+	uint primCount = 0, nodesUsed = 1;
+};
+
+}
@@ -41,12 +41,17 @@ void Renderer::Init()
 	// create fp32 rgb pixel buffer to render to
 	accumulator = (float4*)MALLOC64( SCRWIDTH * SCRHEIGHT * 16 );
 	memset( accumulator, 0, SCRWIDTH * SCRHEIGHT * 16 );
+	sampleCount = (uint*)MALLOC64( SCRWIDTH * SCRHEIGHT * 4 );
+	memset( sampleCount, 0, SCRWIDTH * SCRHEIGHT * 4 );
 	camera = new Camera(scene.GetCameraPos(0), scene.GetCameraTarget(0));
+	tileOrder.Build(frameOrder);
+	sampler.Init();
 }
 
-float3 Renderer::Trace(Ray& ray)
+// r: a point on the light (r.x, r.y: the stratified Sobol pair) and the light selection (r.z)
+template <int SCENE, int TYPE> float3 Renderer::Trace(Ray& ray, const float3 r)
 {
-	scene.FindNearest(ray);
+	scene.FindNearest<SCENE, TYPE>(ray);
 	int currIntTests = scene.intersectionTests;
 	int currTravSteps = scene.traversalSteps;
 	intersectionTestsPrimary += currIntTests;
@@ -54,29 +59,28 @@ float3 Renderer::Trace(Ray& ray)
 
 	if (ray.objIdx == -1) return 0; // or a fancy sky color
 	float3 I = ray.O + ray.t * ray.D;
-	float3 N = scene.GetNormal(ray.objIdx, I, ray.D);
-	//return scene.GetAlbedo(ray.objIdx, I);
+	float3 N = scene.GetNormal<SCENE, TYPE>(ray, I);
+	//return scene.GetAlbedo<SCENE, TYPE>(ray, I);
 
 
-	uint seed = 0;
-	uint quadIdx = scene.GetRandomLight(seed);
+	uint quadIdx = scene.GetRandomLight(r.z);
 	Quad quad = scene.GetLightQuad(quadIdx);
-	float3 L = scene.RandomPointOnLightQuad(quadIdx, seed) - I;
+	float3 L = scene.PointOnLightQuad(quadIdx, r.x, r.y) - I;
 	float dist = length(L);
 	L /= dist;
 	float cos_o = dot(-L, quad.GetNormal(I));
 	float cos_i = dot(L, N);
 	if ((cos_o <= 0) || (cos_i <= 0)) return float3(0);
 
-	Ray shadowRay = Ray(I + DBL_EPSILON * L, L, dist - 2 * DBL_EPSILON);
-	scene.FindNearest(shadowRay);
+	Ray shadowRay = Ray(I + SHADOW_EPSILON * L, L, dist - 2 * SHADOW_EPSILON);
+	const bool occluded = scene.IsOccluded<SCENE, TYPE>(shadowRay);
 
 	intersectionTestsShadow += scene.intersectionTests - currIntTests;
 	traversalStepsShadow += scene.traversalSteps - currTravSteps;
-	if (shadowRay.objIdx == -1) return float3(0);
+	if (occluded) return float3(0);
 
 
-	float3 albedo = scene.GetAlbedo(ray.objIdx, I);
+	float3 albedo = scene.GetAlbedo<SCENE, TYPE>(ray, I);
 	float3 BRDF = albedo / PI;
 	float solidAngle = (scene.GetLightArea() * cos_o) / (dist * dist);
 	/* visualize normal */ // return (N + 1) * 0.5f;
@@ -86,59 +90,174 @@ float3 Renderer::Trace(Ray& ray)
 }
 
 // -----------------------------------------------------------
-// Main application tick function - Executed once per frame
+// Render one frame with the kernels of one scene / structure
 // -----------------------------------------------------------
-void Renderer::Tick( float deltaTime )
+// returns the number of samples taken
+template <int SCENE, int TYPE> uint Renderer::Render()
 {
-	// animation
-	if (animating) scene.SetTime( anim_time += deltaTime * 0.002f );
-	// pixel loop
-	Timer t;
+	uint traced = 0;
+	if (frameOrder == 0)
+	{
+		// lines are executed as OpenMP parallel tasks (disabled in DEBUG)
+#pragma omp parallel for schedule(dynamic) reduction(+ : traced)
+		for (int y = 0; y < SCRHEIGHT; y++)
+		{
+			// trace a primary ray for each pixel on the line
+			for (int x = 0; x < SCRWIDTH; x++) traced += RenderPixel<SCENE, TYPE>(x, y);
+		}
+		return traced;
+	}
+	// tiles are the parallel tasks; pixels in a tile are visited in Morton order
+	const int tileCount = (int)tileOrder.tiles.size();
+#pragma omp parallel for schedule(dynamic) reduction(+ : traced)
+	for (int i = 0; i < tileCount; i++)
+	{
+		const int2 tile = tileOrder.tiles[i];
+		for (const int2& p : tileOrder.pixels)
+		{
+			const int x = tile.x + p.x, y = tile.y + p.y;
+			if (x < SCRWIDTH && y < SCRHEIGHT) traced += RenderPixel<SCENE, TYPE>(x, y);
+		}
+	}
+	return traced;
+}
 
-	// lines are executed as OpenMP parallel tasks (disabled in DEBUG)
-#pragma omp parallel for schedule(dynamic)
-	for (int y = 0; y < SCRHEIGHT; y++)
+// returns the number of samples taken
+template <int SCENE, int TYPE> uint Renderer::RenderPixel(int x, int y)
+{
+	const uint pixelIdx = x + y * SCRWIDTH;
+	if (spp == 0) accumulator[pixelIdx] = float4(0), sampleCount[pixelIdx] = 0;
+	// the heat map traces every pixel once
+	const uint samples = heatMap ? 1 : SamplesThisPass(pixelIdx);
+	for (uint i = 0; i < samples; i++)
 	{
-		// trace a primary ray for each pixel on the line
-		for (int x = 0; x < SCRWIDTH; x++)
+		// a private random stream per pixel and sample: no shared state between the
+		// threads, and the same image for any thread count or tile order
+		const uint sampleIdx = sampleCount[pixelIdx];
+		uint seed = InitSeed(pixelIdx + InitSeed(sampleIdx));
+		const float3 r = sampler.Get(x, y, sampleIdx, seed);
+		Ray ray = camera->GetPrimaryRay((float)x, (float)y);
+		const float3 sample = Trace<SCENE, TYPE>(ray, r);
+		if (!heatMap)
+		{
+			// w gathers the squared luminance, for the variance estimate of PixelError
+			const float luminance = dot(sample, float3(0.2126f, 0.7152f, 0.0722f));
+			accumulator[pixelIdx] += float4(sample, luminance * luminance);
+			sampleCount[pixelIdx]++;
+		}
+		else
+		{
+			float3 finalColor = remapToGreenRed();
+			float4 v(finalColor.x, finalColor.y, finalColor.z, 1.0f);
+			screen->pixels[x + y * SCRWIDTH] = createRGB(finalColor.x, finalColor.y, finalColor.z);
+		}
+		scene.maxIntersectionTests = max(scene.maxIntersectionTests, scene.intersectionTests);
+		scene.maxTraversalSteps = max(scene.maxTraversalSteps, scene.traversalSteps);
+
+		if (frames < 100) 
 		{
-			float4 pixel = float4(Trace(camera->GetPrimaryRay((float)x, (float)y)), 0);
-			// translate accumulator contents to rgb32 pixels
-			if (!heatMap)
-			{
-				screen->pixels[x + y * SCRWIDTH] = RGBF32_to_RGB8(&pixel);
-			}
-			else
-			{
-				float3 finalColor = remapToGreenRed();
-				float4 v(finalColor.x, finalColor.y, finalColor.z, 1.0f);
-				screen->pixels[x + y * SCRWIDTH] = createRGB(finalColor.x, finalColor.y, finalColor.z);
-			}
-			scene.maxIntersectionTests = max(scene.maxIntersectionTests, scene.intersectionTests);
-			scene.maxTraversalSteps = max(scene.maxTraversalSteps, scene.traversalSteps);
-
-			if (frames < 100) 
-			{
-				minIntersects = min(minIntersects, scene.intersectionTests);
-				minTraverses = min(minTraverses, scene.traversalSteps);
-				traversalSteps += scene.traversalSteps;
-				intersectionTests += scene.intersectionTests;
-				totalPixelsChecked++;
-			}
-
-			scene.intersectionTests = 0;
-			scene.traversalSteps = 0;
+			minIntersects = min(minIntersects, scene.intersectionTests);
+			minTraverses = min(minTraverses, scene.traversalSteps);
+			traversalSteps += scene.traversalSteps;
+			intersectionTests += scene.intersectionTests;
+			totalPixelsChecked++;
 		}
+
+		scene.intersectionTests = 0;
+		scene.traversalSteps = 0;
 	}
+	if (samples && !heatMap) Display(pixelIdx);
+	return samples;
+}
+
+// standard error of the pixel's mean luminance, sqrt(variance / n); 1e30 while its
+// variance estimate isn't trusted yet: a handful of samples can all miss a small light
+float Renderer::PixelError(uint pixelIdx) const
+{
+	const uint n = sampleCount[pixelIdx];
+	if (n < max(ADAPTIVE_MIN_SPP, 2)) return 1e30f;
+	const float4& sum = accumulator[pixelIdx];
+	const float mean = dot(make_float3(sum), float3(0.2126f, 0.7152f, 0.0722f)) / n;
+	const float variance = max(0.0f, sum.w / n - mean * mean) * n / (n - 1);
+	const float error = sqrtf(variance / n);
+	// surely brighter than white: the noise never reaches the screen
+	return mean - 3 * error > 1 ? 0 : error;
+}
+
+// adaptive sampling: after ADAPTIVE_MIN_SPP samples everywhere, a pass gives each
+// pixel a number of samples proportional to its error, relative to the average
+// error of the frame, until the error drops below the target. Flat, fully lit or
+// fully shadowed surfaces soon stop; penumbrae under the four lights keep sampling.
+uint Renderer::SamplesThisPass(uint pixelIdx) const
+{
+	if (!adaptive) return 1;
+	const float error = PixelError(pixelIdx);
+	if (error == 1e30f) return 1;
+	if (error <= errorTarget) return 0;
+	return min((uint)ADAPTIVE_MAX_PASS, (uint)(error / meanError + 0.5f));
+}
+
+// average error over the pixels past the warm-up, for the next pass
+float Renderer::MeanError() const
+{
+	double sum = 0;
+	int count = 0;
+#pragma omp parallel for reduction(+ : sum, count)
+	for (int i = 0; i < SCRWIDTH * SCRHEIGHT; i++)
+	{
+		const float error = PixelError(i);
+		if (error != 1e30f) sum += error, count++;
+	}
+	return count ? (float)(sum / count) : 1e30f;
+}
+
+// translate accumulator contents to an rgb32 pixel, or show its sample count
+void Renderer::Display(uint pixelIdx)
+{
+	const uint n = sampleCount[pixelIdx];
+	if (densityMap)
+	{
+		// green at the minimum sample count, red at four times the average budget
+		const float a = remap(sqrtf((float)n), sqrtf((float)ADAPTIVE_MIN_SPP), sqrtf(4.0f * sampleTarget), 0.0f, 1.0f);
+		const float3 color = (float3(1, 0, 0) * a + float3(0, 0.8f, 0) * (1.0f - a)) * 255;
+		screen->pixels[pixelIdx] = createRGB(color.x, color.y, color.z);
+		return;
+	}
+	float4 pixel = n ? accumulator[pixelIdx] * (1.0f / n) : float4(0);
+	screen->pixels[pixelIdx] = RGBF32_to_RGB8(&pixel);
+}
+
+// -----------------------------------------------------------
+// Main application tick function - Executed once per frame
+// -----------------------------------------------------------
+void Renderer::Tick( float deltaTime )
+{
+	// animation; a changing scene restarts the accumulation
+	if (animating) scene.SetTime( anim_time += deltaTime * 0.002f ), spp = 0;
+	// handle user input
+	if (camera->HandleInput( deltaTime )) spp = 0;
+	if (spp == 0) samplesTaken = 0, converged = false;
+	// the display mode changed: redraw from the accumulator
+	if (redisplay && !heatMap) for (uint i = 0; i < SCRWIDTH * SCRHEIGHT; i++) Display(i);
+	redisplay = false;
+	// budget spent or every pixel converged: keep showing the last frame (the heat map is never accumulated)
+	const uint64_t budget = (uint64_t)sampleTarget * SCRWIDTH * SCRHEIGHT;
+	if ((samplesTaken >= budget || converged) && !heatMap) return;
+	// pixel loop
+	Timer t;
+
+	// one dispatch per frame, to the pixel loop compiled for this scene and structure
+	if (adaptive && !heatMap) meanError = MeanError();
+	uint traced = 0;
+	scene.Dispatch( [&]( auto sceneIdx, auto type ) { traced = Render<decltype(sceneIdx)::value, decltype(type)::value>(); } );
+	if (!heatMap) spp++, samplesTaken += traced, converged = traced == 0;
 
 	// performance report - running average - ms, MRays/s
 	static float avg = 10, alpha = 1;
 	avg = (1 - alpha) * avg + alpha * t.elapsed() * 1000;
 	if (alpha > 0.05f) alpha *= 0.5f;
-	float fps = 1000.0f / avg, rps = (SCRWIDTH * SCRHEIGHT) / avg;
+	float fps = 1000.0f / avg, rps = traced / avg;
 	//printf( "%5.2fms (%.1ffps) - %.1fMrays/s\n", avg, fps, rps / 1000 );
-	// handle user input
-	camera->HandleInput( deltaTime );
 	frames++;
 	if (frames == 100) 
 	{
@@ -146,6 +265,8 @@ void Renderer::Tick( float deltaTime )
 		cout << "TRAVERS " << scene.maxTraversalSteps << " " << minTraverses << " " << traversalSteps / totalPixelsChecked << "\n";
 		cout << "PRIMARY RAYS: INTERS " << intersectionTestsPrimary / totalPixelsChecked << " TRAVERS " << traversalStepsPrimary / totalPixelsChecked << "\n";
 		cout << "SHADOW RAYS: INTERS " << intersectionTestsShadow / totalPixelsChecked << " TRAVERS " << traversalStepsShadow / totalPixelsChecked << "\n";
+		cout << "PERF " << avg << "ms " << rps / 1000 << "MRays/s\n";
+		scene.mesh.paged.Report();
 
 	}
 	//cout << camera->camPos.x << " " << camera->camPos.y << " " << camera->camPos.z << " " << camera->camTarget.x << " " << camera->camTarget.y << " " << camera->camTarget.z << "\n";
@@ -158,8 +279,9 @@ void Renderer::UI()
 {
 	// animation toggle
 	ImGui::Checkbox( "Animate scene", &animating );
-	ImGui::Checkbox("Acceleration structure", &scene.accelStruct);
-	ImGui::Checkbox("Heat Map", &heatMap); ImGui::SameLine();
+	if (ImGui::Checkbox("Acceleration structure", &scene.accelStruct)) spp = 0; // without it, meshes disappear
+	if (ImGui::Checkbox("Heat Map", &heatMap)) spp = 0;
+	ImGui::SameLine();
 	const char* items[] = { "Intersection Tests", "Traversal Steps"};
 	static int item_selected_idx = 0; // Here we store our selection data as an index.
 
@@ -185,9 +307,15 @@ void Renderer::UI()
 	static int e = scene.accelStructType;
 	ImGui::RadioButton("BVH", &e, 0); ImGui::SameLine();
 	ImGui::RadioButton("kD-tree", &e, 1); ImGui::SameLine();
-	ImGui::RadioButton("Octree", &e, 2);
+	ImGui::RadioButton("Octree", &e, 2); ImGui::SameLine();
+	ImGui::RadioButton("Grid", &e, 3); ImGui::SameLine();
+	ImGui::RadioButton("2-level grid", &e, 4); ImGui::SameLine();
+	ImGui::RadioButton("BIH", &e, 5); ImGui::SameLine();
+	ImGui::RadioButton("Paged BVH", &e, 6); ImGui::SameLine();
+	ImGui::RadioButton("Auto", &e, BLAS_AUTO);
 
-	scene.accelStructType = e;
+	if (scene.accelStructType != e) scene.SetAccelStructType(e), spp = 0;
+	if (e == BLAS_AUTO && scene.mesh.selected >= 0) ImGui::Text("Auto: the mesh uses its fastest structure, %s", BLAS::Name(scene.mesh.selected));
 
 	//static int f = scene.SceneIdx;
 	//static int fOld = f;
@@ -207,6 +335,7 @@ void Renderer::UI()
 		camera->camPos = scene.GetCameraPos(g);
 		camera->camTarget = scene.GetCameraTarget(g);
 		camera->Update();
+		spp = 0;
 		scene.maxIntersectionTests = 0;
 		scene.maxTraversalSteps = 0;
 		traversalSteps = 0;
@@ -223,6 +352,26 @@ void Renderer::UI()
 	}
 	gOld = g;
 
+	static int o = frameOrder;
+	ImGui::RadioButton("Scanlines", &o, 0); ImGui::SameLine();
+	ImGui::RadioButton("Morton tiles", &o, 1); ImGui::SameLine();
+	ImGui::RadioButton("Hilbert tiles", &o, 2);
+	if (o != frameOrder) tileOrder.Build(frameOrder = o);
+
+	static int sampler_type = sampler.type;
+	ImGui::RadioButton("Uniform", &sampler_type, 0); ImGui::SameLine();
+	ImGui::RadioButton("Sobol", &sampler_type, 1); ImGui::SameLine();
+	ImGui::RadioButton("Blue noise", &sampler_type, 2);
+	if (sampler_type != sampler.type) sampler.type = sampler_type, spp = 0;
+
+	ImGui::SliderInt("Sample target", &sampleTarget, 1, 4096);
+	if (ImGui::Checkbox("Adaptive sampling", &adaptive)) spp = 0;
+	ImGui::SameLine();
+	if (ImGui::Checkbox("Sample density", &densityMap)) redisplay = true;
+	// a lower target revives converged pixels; no restart needed
+	if (ImGui::SliderFloat("Error target", &errorTarget, 0.001f, 0.1f, "%.3f", ImGuiSliderFlags_Logarithmic)) converged = false;
+	ImGui::Text("Samples: %.1f / %i per pixel%s", (float)samplesTaken / (SCRWIDTH * SCRHEIGHT), sampleTarget, converged ? " (converged)" : "");
+
 	ImGui::LabelText(std::to_string(scene.maxIntersectionTests).c_str(), "Max # intersection tests:");
 	ImGui::LabelText(std::to_string(scene.maxTraversalSteps).c_str(), "Max # Traversal steps:");
 	
@@ -1,5 +1,14 @@
 #pragma once
 #include "precomp.h"
+#include "tiles.h"
+#include "sampler.h"
+
+#define SAMPLE_TARGET	256		// sample budget: progressive rendering idles after this many samples per pixel, on average
+#define ADAPTIVE_SAMPLING	1		// spend the budget on the pixels with the largest error
+#define ADAPTIVE_MIN_SPP	16		// samples every pixel gets before its variance estimate is trusted
+#define ADAPTIVE_MAX_PASS	8		// samples a single pixel may take in one pass
+#define ADAPTIVE_ERROR		0.005f	// a pixel converges when the standard error of its mean luminance drops below this
+#define SHADOW_EPSILON		1e-3f	// shadow rays start and stop this far from their end points, clear of the surfaces
 
 namespace Tmpl8
 {
@@ -9,7 +18,13 @@ class Renderer : public TheApp
 public:
 	// game flow methods
 	void Init();
-	float3 Trace(Ray& ray);
+	template <int SCENE, int TYPE> float3 Trace(Ray& ray, const float3 r);
+	template <int SCENE, int TYPE> uint Render();
+	template <int SCENE, int TYPE> uint RenderPixel(int x, int y);
+	float PixelError(uint pixelIdx) const;
+	uint SamplesThisPass(uint pixelIdx) const;
+	float MeanError() const;
+	void Display(uint pixelIdx);
 	float3 GetColor( Ray& ray );
 	void Tick( float deltaTime );
 	void UI();
@@ -23,10 +38,23 @@ public:
 	void KeyDown( int key ) { /* implement if you want to handle keys */ }
 	// data members
 	int2 mousePos;
-	float4* accumulator;
+	float4* accumulator;		// per pixel: sum of its samples, and of their squared luminance in w
+	uint* sampleCount;			// per pixel: number of samples in the accumulator
+	uint spp = 0;				// accumulation passes since the last restart
+	uint64_t samplesTaken = 0;	// in those passes, over all pixels
+	bool converged = false;		// the last pass found no pixel that needed another sample
+	int sampleTarget = SAMPLE_TARGET;
+	bool adaptive = ADAPTIVE_SAMPLING;
+	float errorTarget = ADAPTIVE_ERROR;
+	float meanError = 1e30f;	// over the frame, at the start of this pass
+	bool densityMap = false;	// show the samples per pixel instead of the image
+	bool redisplay = false;		// redraw the screen from the accumulator
+	int frameOrder = TILE_ORDER;
+	TileOrder tileOrder;
+	Sampler sampler;
 	Scene scene;
 	Camera* camera;
-	bool animating = true;
+	bool animating = false;
 	float anim_time = 0;
 	bool heatMap;
 	bool intersectionHeatMap;
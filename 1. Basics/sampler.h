@@ -0,0 +1,127 @@
+#pragma once
+
+#define SAMPLER_TYPE		1		// 0: uniform random, 1: Owen-scrambled Sobol, 2: blue-noise rotated Sobol
+#define SAMPLER_DIMS		3		// per sample: a point on a light (dimensions 0, 1), then the light selection
+#define BLUE_NOISE_SIZE		64		// side of the blue-noise tile, a power of two
+
+namespace Tmpl8 {
+
+// -----------------------------------------------------------
+// Sample generators for the light sampling in Trace. Each
+// pixel draws sample spp from one of:
+// - uniform: independent random numbers from the pixel's seed;
+// - Sobol: dimensions 0 and 1 form a (0,2)-sequence, so the 2D
+//   point on the light gets them; dimension 2 is stratified on
+//   its own only. A hashed nested uniform (Owen) scramble that
+//   is different for every pixel decorrelates the pixels, and
+//   each stays stratified;
+// - blue noise: the unscrambled Sobol sequence, rotated per
+//   pixel (Cranley-Patterson) by a tiled blue-noise mask, so
+//   the error of low sample counts is spread as high-frequency
+//   noise that the eye and a filter average out.
+// -----------------------------------------------------------
+class Sampler
+{
+public:
+	void Init()
+	{
+		// Sobol direction numbers (Joe & Kuo); dimension 0 is the van der Corput sequence
+		static const uint s[SAMPLER_DIMS] = { 0, 1, 2 }, a[SAMPLER_DIMS] = { 0, 0, 1 };
+		static const uint m[SAMPLER_DIMS][2] = { { 0, 0 }, { 1, 0 }, { 1, 3 } };
+		for (int d = 0; d < SAMPLER_DIMS; d++) for (uint i = 0; i < 32; i++)
+		{
+			if (d == 0) { direction[d][i] = 1u << (31 - i); continue; }
+			if (i < s[d]) { direction[d][i] = m[d][i] << (31 - i); continue; }
+			uint v = direction[d][i - s[d]] ^ (direction[d][i - s[d]] >> s[d]);
+			for (uint k = 1; k < s[d]; k++) if ((a[d] >> (s[d] - 1 - k)) & 1) v ^= direction[d][i - k];
+			direction[d][i] = v;
+		}
+		BuildBlueNoise();
+	}
+
+	// the SAMPLER_DIMS values of sample sampleIdx of pixel (x, y), in [0, 1)
+	float3 Get(int x, int y, uint sampleIdx, uint& seed) const
+	{
+		if (type == 0) return float3(RandomFloat(seed), RandomFloat(seed), RandomFloat(seed));
+		uint v[SAMPLER_DIMS];
+		if (type == 1)
+		{
+			// shuffle the sample order and scramble every dimension, all keyed on the pixel
+			const uint key = InitSeed(x + y * SCRWIDTH);
+			Sobol(Scramble(sampleIdx, key), v);
+			return float3(ToFloat(Scramble(v[0], key + 1)), ToFloat(Scramble(v[1], key + 2)), ToFloat(Scramble(v[2], key + 3)));
+		}
+		Sobol(sampleIdx, v);
+		float3 r;
+		for (int dim = 0; dim < SAMPLER_DIMS; dim++)
+		{
+			// a different part of the tile for every dimension keeps the dimensions uncorrelated
+			const uint bx = (x + dim * 23) & (BLUE_NOISE_SIZE - 1), by = (y + dim * 41) & (BLUE_NOISE_SIZE - 1);
+			const float f = ToFloat(v[dim]) + blueNoise[bx + by * BLUE_NOISE_SIZE];
+			r[dim] = f < 1 ? f : f - 1;
+		}
+		return r;
+	}
+
+	void Sobol(uint idx, uint v[SAMPLER_DIMS]) const
+	{
+		for (int dim = 0; dim < SAMPLER_DIMS; dim++) v[dim] = 0;
+		for (uint i = 0; idx; idx >>= 1, i++) if (idx & 1)
+			for (int dim = 0; dim < SAMPLER_DIMS; dim++) v[dim] ^= direction[dim][i];
+	}
+	// hash-based nested uniform scramble (Burley, "Practical Hash-based Owen Scrambling", 2020):
+	// the Laine-Karras permutation lets each bit depend on the lower ones only; between two bit
+	// reversals every bit depends on the more significant ones, as Owen scrambling requires
+	static uint Scramble(uint v, uint seed)
+	{
+		v = ReverseBits(v);
+		v += seed;
+		v ^= v * 0x6c50b47c;
+		v ^= v * 0xb82f1e52;
+		v ^= v * 0xc7afe638;
+		v ^= v * 0x8d22f6e6;
+		return ReverseBits(v);
+	}
+	static uint ReverseBits(uint v)
+	{
+		v = ((v >> 1) & 0x55555555) | ((v & 0x55555555) << 1);
+		v = ((v >> 2) & 0x33333333) | ((v & 0x33333333) << 2);
+		v = ((v >> 4) & 0x0f0f0f0f) | ((v & 0x0f0f0f0f) << 4);
+		v = ((v >> 8) & 0x00ff00ff) | ((v & 0x00ff00ff) << 8);
+		return (v >> 16) | (v << 16);
+	}
+	// top 24 bits, so the result stays below 1
+	static float ToFloat(uint v) { return (v >> 8) * (1.0f / (1 << 24)); }
+
+	// void-and-cluster (Ulichney 1993), in its void filling form: pixels are ranked in
+	// the order in which they fill the largest void of those ranked before them
+	void BuildBlueNoise()
+	{
+		Timer t;
+		const int n = BLUE_NOISE_SIZE, r = 6;
+		const float sigma2 = 2 * 1.9f * 1.9f;
+		vector<float> energy(n * n, 0);
+		vector<bool> ranked(n * n, false);
+		float kernel[2 * r + 1][2 * r + 1];
+		for (int dy = -r; dy <= r; dy++) for (int dx = -r; dx <= r; dx++)
+			kernel[dy + r][dx + r] = expf(-(dx * dx + dy * dy) / sigma2);
+		for (int rank = 0; rank < n * n; rank++)
+		{
+			int best = -1;
+			for (int i = 0; i < n * n; i++) if (!ranked[i] && (best < 0 || energy[i] < energy[best])) best = i;
+			ranked[best] = true;
+			blueNoise[best] = (rank + 0.5f) / (n * n);
+			// the energy wraps around, so the tile repeats seamlessly
+			const int bx = best % n, by = best / n;
+			for (int dy = -r; dy <= r; dy++) for (int dx = -r; dx <= r; dx++)
+				energy[((bx + dx) & (n - 1)) + ((by + dy) & (n - 1)) * n] += kernel[dy + r][dx + r];
+		}
+		printf("Sampler: %ix%i blue-noise tile built in %.1f ms\n", n, n, t.elapsed() * 1000);
+	}
+
+	int type = SAMPLER_TYPE;
+	uint direction[SAMPLER_DIMS][32];
+	float blueNoise[BLUE_NOISE_SIZE * BLUE_NOISE_SIZE];	// rank of each pixel, as a value in (0, 1)
+};
+
+}
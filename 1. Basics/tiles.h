@@ -0,0 +1,71 @@
+#pragma once
+
+#define TILE_SIZE	16		// pixels per tile side; a power of two
+#define TILE_ORDER	1		// frame traversal: 0 scanlines, 1 Morton tiles, 2 Hilbert tiles
+
+namespace Tmpl8 {
+
+// -----------------------------------------------------------
+// Frame traversal order. Nearby pixels shoot coherent rays;
+// walking the screen in small tiles, with the tiles and the
+// pixels inside them along a space-filling curve, keeps the
+// nodes and triangles that consecutive rays visit in cache.
+// A tile is also the unit of work for the render threads.
+// -----------------------------------------------------------
+class TileOrder
+{
+public:
+	void Build(int order)
+	{
+		// the curve covers the smallest power-of-two square of tiles around the screen
+		const int tilesX = (SCRWIDTH + TILE_SIZE - 1) / TILE_SIZE, tilesY = (SCRHEIGHT + TILE_SIZE - 1) / TILE_SIZE;
+		uint n = 1;
+		while (n < (uint)max(tilesX, tilesY)) n *= 2;
+		tiles.clear();
+		for (uint d = 0; d < n * n; d++)
+		{
+			uint x, y;
+			if (order == 2) Hilbert(n, d, x, y); else Morton(d, x, y);
+			if (x < (uint)tilesX && y < (uint)tilesY) tiles.push_back(make_int2(x * TILE_SIZE, y * TILE_SIZE));
+		}
+		for (uint i = 0; i < TILE_SIZE * TILE_SIZE; i++)
+		{
+			uint x, y;
+			Morton(i, x, y);
+			pixels[i] = make_int2(x, y);
+		}
+	}
+
+	// point d on the Morton (Z-order) curve: x and y are the even and odd bits of d
+	static void Morton(uint d, uint& x, uint& y) { x = Compact(d), y = Compact(d >> 1); }
+	static uint Compact(uint v)
+	{
+		v &= 0x55555555;
+		v = (v ^ (v >> 1)) & 0x33333333;
+		v = (v ^ (v >> 2)) & 0x0f0f0f0f;
+		v = (v ^ (v >> 4)) & 0x00ff00ff;
+		v = (v ^ (v >> 8)) & 0x0000ffff;
+		return v;
+	}
+	// point d on the Hilbert curve over an n x n grid, n a power of two; unlike
+	// Morton order, consecutive points are always adjacent
+	static void Hilbert(uint n, uint d, uint& x, uint& y)
+	{
+		x = y = 0;
+		for (uint s = 1; s < n; s *= 2, d /= 4)
+		{
+			const uint rx = 1 & (d / 2), ry = 1 & (d ^ rx);
+			if (ry == 0)
+			{
+				if (rx == 1) x = s - 1 - x, y = s - 1 - y;
+				swap(x, y);
+			}
+			x += s * rx, y += s * ry;
+		}
+	}
+
+	vector<int2> tiles;						// top-left pixel of each tile, in walk order
+	int2 pixels[TILE_SIZE * TILE_SIZE];		// offsets inside a tile, in Morton order
+};
+
+}
@@ -0,0 +1,433 @@
+#pragma once
+#include "bvh.h"
+#include "kdtree.h"
+#include "octree.h"
+#include "grid.h"
+#include "hgrid.h"
+#include "bih.h"
+#include "pagedbvh.h"
+
+#define BLAS_SAMPLE_RAYS	4096	// rays traced per structure to pick the fastest
+#define BLAS_TYPES			7
+#define BLAS_PAGED			6	// out of core; BLAS_AUTO never picks it, select it explicitly
+#define BLAS_AUTO			BLAS_TYPES	// accelStructType: the fastest structure of each mesh
+
+namespace Tmpl8 {
+
+// -----------------------------------------------------------
+// Bottom-level acceleration structures of one mesh, in object
+// space. Only the structure in use is in memory: Use builds it
+// (or loads it from its cache) and releases the others. With
+// BLAS_AUTO, every in-core structure is timed once and the
+// fastest is kept; the paged BVH is left out, as timing it would
+// write its page file next to the asset.
+// -----------------------------------------------------------
+class BLAS
+{
+public:
+	BLAS() = default;
+	BLAS(const char* objFile, int objIdx, const float scale = 1, float3 offset = 0)
+		: asset(objFile), objIdx(objIdx), scale(scale), offset(offset) {}
+	// every structure, one at a time, so their caches exist before the first interactive run;
+	// false when the mesh didn't load or a cache couldn't be written
+	bool Build()
+	{
+		if (asset.empty()) return false;
+		const shared_ptr<Mesh> m = GetMesh();
+		if (!m->triCount) return false;
+		bool ok = true;
+		for (int type = 0; type < BLAS_TYPES; type++) ok &= Require(type), Release(type);
+		return ok;
+	}
+	// make the structure for accelStructType the only one in memory; between frames only.
+	// False, and nothing is built, when the mesh didn't load
+	bool Use(int accelStructType)
+	{
+		if (asset.empty()) return false;
+		const shared_ptr<Mesh> m = GetMesh();
+		if (!m->triCount) return false;
+		if (accelStructType == BLAS_AUTO && selected < 0) Select();
+		const int type = Type(accelStructType);
+		Require(type);
+		for (int t = 0; t < BLAS_TYPES; t++) if (t != type) Release(t);
+		return true;
+	}
+	// the geometry, shared by the structures that are built; loaded again after
+	// the last of them released it
+	shared_ptr<Mesh> GetMesh()
+	{
+		shared_ptr<Mesh> m = geometry.lock();
+		if (m) return m;
+		geometry = m = make_shared<Mesh>(asset.c_str(), objIdx, scale, offset);
+		// object space bounds, for the instances and the sample rays of Select
+#ifdef MESH_COMPRESSED
+		aabbMin = m->qMin, aabbMax = m->qMin + m->qScale * 65535;
+#else
+		aabbMin = float3(1e30f), aabbMax = float3(-1e30f);
+		for (uint i = 0; i < m->vertexCount; i++) aabbMin = fminf(aabbMin, m->P[i]), aabbMax = fmaxf(aabbMax, m->P[i]);
+#endif
+		return m;
+	}
+	// build or load one structure; false when its cache or page file couldn't be written
+	bool Require(int type)
+	{
+		if (built[type]) return true;
+		bool stored = true;
+		switch (type)
+		{
+		case 0: bvh = BVH(GetMesh()), stored = Build(bvh, "bvh"); break;
+		case 1: kdtree = KDTree(GetMesh()), stored = Build(kdtree, "kd"); break;
+		case 2: oct = Octree(GetMesh()), stored = Build(oct, "oct"); break;
+		case 3: grid = Grid(GetMesh()), stored = Build(grid, "grid"); break;
+		case 4: hgrid = HGrid(GetMesh()), stored = Build(hgrid, "hgrid"); break;
+		case 5: bih = BIH(GetMesh()), stored = Build(bih, "bih"); break;
+		default:
+		{
+			// out of core: the page file holds positions and normals, so neither the mesh nor
+			// the in-core BVH stay; the mesh is only loaded (mapped) to check the file's hash
+			const uint64_t hash = GetMesh()->Hash();
+			paged.objIdx = objIdx;
+			if (paged.Load(asset, hash)) break;
+			const bool bvhInUse = built[0];
+			Require(0);
+			stored = paged.Build(bvh, asset, hash);
+			if (!bvhInUse) Release(0);
+			break;
+		}
+		}
+		built[type] = true;
+		return stored;
+	}
+	void Release(int type)
+	{
+		if (!built[type]) return;
+		switch (type)
+		{
+		case 0: bvh.Free(); break;
+		case 1: kdtree.Free(); break;
+		case 2: oct.Free(); break;
+		case 3: grid.Free(); break;
+		case 4: hgrid.Free(); break;
+		case 5: bih.Free(); break;
+		default: paged.Free(); break;
+		}
+		built[type] = false;
+	}
+	// load one structure from its cache next to the asset, or build it and store it there
+	template <class T> bool Build(T& accel, const char* type)
+	{
+#ifdef ACCEL_CACHE
+		if (AccelCache::Load(accel, asset, type)) return true;
+		accel.Build();
+		return AccelCache::Save(accel, asset, type);
+#else
+		accel.Build();
+		return true;
+#endif
+	}
+	void Select()
+	{
+		// sample rays: half from outside towards the mesh, half from inside its bounds
+		// in random directions, so both camera and secondary rays are represented
+		GetMesh();
+		vector<Ray> rays;
+		float3 c = (aabbMin + aabbMax) * 0.5f, e = aabbMax - aabbMin;
+		uint seed = 0x12345;
+		for (int i = 0; i < BLAS_SAMPLE_RAYS; i++)
+		{
+			float3 target = c + e * float3(RandomFloat(seed) - .5f, RandomFloat(seed) - .5f, RandomFloat(seed) - .5f);
+			float3 D = normalize(float3(RandomFloat(seed) - .5f, RandomFloat(seed) - .5f, RandomFloat(seed) - .5f));
+			if (i & 1) rays.push_back(Ray(target, D));
+			else rays.push_back(Ray(target - D * length(e) * 2, D));
+		}
+		// time each structure; the first pass warms up the caches and is discarded.
+		// Only the fastest so far stays in memory.
+		float time[BLAS_PAGED];
+		int tests = 0, steps = 0;
+		for (int type = 0; type < BLAS_PAGED; type++)
+		{
+			Require(type);
+			for (int pass = 0; pass < 2; pass++)
+			{
+				Timer t;
+				for (Ray ray : rays) Intersect(ray, type, &tests, &steps);
+				time[type] = t.elapsed();
+			}
+			if (selected < 0 || time[type] < time[selected]) selected = type;
+			for (int t = 0; t < BLAS_PAGED; t++) if (t != selected) Release(t);
+		}
+		printf("BLAS: %s selected %s (%.2f Mrays/s;", asset.c_str(), Name(selected), BLAS_SAMPLE_RAYS / time[selected] * 1e-6f);
+		for (int type = 0; type < BLAS_PAGED; type++) if (type != selected) printf(" %s %.2f", Name(type), BLAS_SAMPLE_RAYS / time[type] * 1e-6f);
+		printf(")\n");
+	}
+	static const char* Name(int type)
+	{
+		static const char* names[BLAS_TYPES] = { "BVH", "kD-tree", "Octree", "Grid", "2-level grid", "BIH", "Paged BVH" };
+		return names[type];
+	}
+	// one structure, fixed at compile time: the specialized scene kernels call these,
+	// so the structure is picked once per frame instead of per ray
+	template <int TYPE> void Intersect(Ray& ray, int* intersectionTests, int* traversalSteps)
+	{
+		static_assert(TYPE >= 0 && TYPE < BLAS_TYPES, "no such structure");
+		if constexpr (TYPE == 0) bvh.Intersect(ray, bvh.rootNodeIdx, intersectionTests, traversalSteps);
+		else if constexpr (TYPE == 1) kdtree.Intersect(ray, kdtree.rootNodeIdx, intersectionTests, traversalSteps);
+		else if constexpr (TYPE == 2) oct.Intersect(ray, oct.rootNodeIdx, intersectionTests, traversalSteps);
+		else if constexpr (TYPE == 3) grid.Intersect(ray, grid.rootNodeIdx, intersectionTests, traversalSteps);
+		else if constexpr (TYPE == 4) hgrid.Intersect(ray, hgrid.rootNodeIdx, intersectionTests, traversalSteps);
+		else if constexpr (TYPE == 5) bih.Intersect(ray, bih.rootNodeIdx, intersectionTests, traversalSteps);
+		else paged.Intersect(ray, paged.rootNodeIdx, intersectionTests, traversalSteps);
+	}
+	template <int TYPE> float3 GetNormal(uint primIdx, float u, float v) const
+	{
+		static_assert(TYPE >= 0 && TYPE < BLAS_TYPES, "no such structure");
+		if constexpr (TYPE == 0) return bvh.GetNormal(primIdx, u, v);
+		else if constexpr (TYPE == 1) return kdtree.GetNormal(primIdx, u, v);
+		else if constexpr (TYPE == 2) return oct.GetNormal(primIdx, u, v);
+		else if constexpr (TYPE == 3) return grid.GetNormal(primIdx, u, v);
+		else if constexpr (TYPE == 4) return hgrid.GetNormal(primIdx, u, v);
+		else if constexpr (TYPE == 5) return bih.GetNormal(primIdx, u, v);
+		else return paged.GetNormal(primIdx, u, v);
+	}
+	template <int TYPE> float3 GetAlbedo() const
+	{
+		static_assert(TYPE >= 0 && TYPE < BLAS_TYPES, "no such structure");
+		if constexpr (TYPE == 0) return bvh.GetAlbedo();
+		else if constexpr (TYPE == 1) return kdtree.GetAlbedo();
+		else if constexpr (TYPE == 2) return oct.GetAlbedo();
+		else if constexpr (TYPE == 3) return grid.GetAlbedo();
+		else if constexpr (TYPE == 4) return hgrid.GetAlbedo();
+		else if constexpr (TYPE == 5) return bih.GetAlbedo();
+		else return paged.GetAlbedo();
+	}
+	// the same, selected at runtime
+	void Intersect(Ray& ray, int accelStructType, int* intersectionTests, int* traversalSteps)
+	{
+		switch (Type(accelStructType))
+		{
+		case 0: Intersect<0>(ray, intersectionTests, traversalSteps); break;
+		case 1: Intersect<1>(ray, intersectionTests, traversalSteps); break;
+		case 2: Intersect<2>(ray, intersectionTests, traversalSteps); break;
+		case 3: Intersect<3>(ray, intersectionTests, traversalSteps); break;
+		case 4: Intersect<4>(ray, intersectionTests, traversalSteps); break;
+		case 5: Intersect<5>(ray, intersectionTests, traversalSteps); break;
+		default: Intersect<6>(ray, intersectionTests, traversalSteps); break;
+		}
+	}
+	float3 GetNormal(int accelStructType, uint primIdx, float u, float v) const
+	{
+		switch (Type(accelStructType))
+		{
+		case 0: return GetNormal<0>(primIdx, u, v);
+		case 1: return GetNormal<1>(primIdx, u, v);
+		case 2: return GetNormal<2>(primIdx, u, v);
+		case 3: return GetNormal<3>(primIdx, u, v);
+		case 4: return GetNormal<4>(primIdx, u, v);
+		case 5: return GetNormal<5>(primIdx, u, v);
+		default: return GetNormal<6>(primIdx, u, v);
+		}
+	}
+	float3 GetAlbedo(int accelStructType) const
+	{
+		switch (Type(accelStructType))
+		{
+		case 0: return GetAlbedo<0>();
+		case 1: return GetAlbedo<1>();
+		case 2: return GetAlbedo<2>();
+		case 3: return GetAlbedo<3>();
+		case 4: return GetAlbedo<4>();
+		case 5: return GetAlbedo<5>();
+		default: return GetAlbedo<6>();
+		}
+	}
+	// the structure that is actually used for a requested one
+	int Type(int accelStructType) const { return accelStructType == BLAS_AUTO ? selected : accelStructType; }
+	BVH bvh;
+	KDTree kdtree;
+	Octree oct;
+	Grid grid;
+	HGrid hgrid;
+	BIH bih;
+	PagedBVH paged;
+	float3 aabbMin, aabbMax;	// object space
+	bool built[BLAS_TYPES] = {};
+	int selected = -1;			// BLAS_AUTO: the fastest structure, once Select ran
+	string asset;				// source file; the structure caches are stored next to it
+	int objIdx = -1;
+	float scale = 1;
+	float3 offset = 0;
+	weak_ptr<Mesh> geometry;	// owned by the structures that are built
+};
+
+// -----------------------------------------------------------
+// One placement of a shared BLAS in the world
+// -----------------------------------------------------------
+struct Instance
+{
+	Instance() = default;
+	Instance(BLAS* b, const mat4& M, int objIdx)
+		: blas(b), transform(M), invTransform(M.Inverted()), normalTransform(invTransform.Transposed()), objIdx(objIdx)
+	{
+		// world space bounds: transformed corners of the object space box
+		aabbMin = float3(1e30f), aabbMax = float3(-1e30f);
+		for (int i = 0; i < 8; i++)
+		{
+			float3 corner((i & 4) ? b->aabbMax.x : b->aabbMin.x, (i & 2) ? b->aabbMax.y : b->aabbMin.y, (i & 1) ? b->aabbMax.z : b->aabbMin.z);
+			float3 P = TransformPosition(corner, transform);
+			aabbMin = fminf(aabbMin, P), aabbMax = fmaxf(aabbMax, P);
+		}
+	}
+	BLAS* blas = 0;
+	mat4 transform, invTransform;
+	mat4 normalTransform;		// inverse transpose: keeps normals perpendicular under any scale or shear
+	float3 aabbMin, aabbMax;
+	int objIdx = -1;			// scene object of this placement; replaces the BLAS' own in hits
+};
+
+// -----------------------------------------------------------
+// Top-level acceleration structure: a BVH over instances. Rays
+// are transformed into object space when they enter an instance,
+// so any number of instances can share one BLAS.
+// -----------------------------------------------------------
+class TLAS
+{
+public:
+	TLAS() = default;
+	void Add(BLAS* blas, const mat4& transform, int objIdx) { instances.push_back(Instance(blas, transform, objIdx)); }
+	void Build()
+	{
+		instCount = (uint)instances.size();
+		delete[] nodes;
+		delete[] instIdx;
+		nodes = new Node[max(instCount * 2, 2u)];
+		instIdx = new uint[max(instCount, 1u)];
+		for (uint i = 0; i < instCount; i++) instIdx[i] = i;
+		nodesUsed = 1;
+		Node& root = nodes[0];
+		root.leftFirst = 0, root.triCount = instCount;
+		UpdateNodeBounds(0);
+		Subdivide(0);
+	}
+	// every instance is traced with BLAS structure TYPE
+	template <int TYPE> void Intersect(Ray& ray, int* intersectionTests, int* traversalSteps)
+	{
+		if (instCount == 0) return;
+		Node* node = &nodes[0], * stack[64];
+		uint stackPtr = 0;
+
+		(*intersectionTests)++;
+		(*traversalSteps)++;
+		if (IntersectAABB(ray, node->aabbMin, node->aabbMax) == 1e30f) return;
+		while (1)
+		{
+			if (node->isLeaf())
+			{
+				for (uint i = 0; i < node->triCount; i++) IntersectInstance<TYPE>(ray, instIdx[node->leftFirst + i], intersectionTests, traversalSteps);
+				if (stackPtr == 0) break; else node = stack[--stackPtr];
+				continue;
+			}
+			Node* child1 = &nodes[node->leftFirst];
+			Node* child2 = &nodes[node->leftFirst + 1];
+			float dist1 = IntersectAABB(ray, child1->aabbMin, child1->aabbMax);
+			float dist2 = IntersectAABB(ray, child2->aabbMin, child2->aabbMax);
+			(*intersectionTests) += 2;
+			if (dist1 > dist2) { swap(dist1, dist2); swap(child1, child2); }
+			if (dist1 == 1e30f)
+			{
+				if (stackPtr == 0) break; else node = stack[--stackPtr];
+			}
+			else
+			{
+				node = child1;
+				(*traversalSteps)++;
+				if (dist2 != 1e30f) stack[stackPtr++] = child2;
+			}
+		}
+	}
+	template <int TYPE> void IntersectInstance(Ray& ray, uint idx, int* intersectionTests, int* traversalSteps)
+	{
+		const Instance& inst = instances[idx];
+		// the object space direction is not renormalized, so distances stay valid in world space
+		Ray objRay(TransformPosition(ray.O, inst.invTransform), TransformVector(ray.D, inst.invTransform), ray.t);
+		inst.blas->Intersect<TYPE>(objRay, intersectionTests, traversalSteps);
+		if (objRay.t < ray.t)
+			ray.t = objRay.t, ray.objIdx = inst.objIdx,
+			ray.primIdx = objRay.primIdx, ray.u = objRay.u, ray.v = objRay.v;
+	}
+	template <int TYPE> float3 GetNormal(uint idx, uint primIdx, float u, float v) const
+	{
+		const Instance& inst = instances[idx];
+		return normalize(TransformVector(inst.blas->GetNormal<TYPE>(primIdx, u, v), inst.normalTransform));
+	}
+	// the same, selected at runtime
+	void Intersect(Ray& ray, int accelStructType, int* intersectionTests, int* traversalSteps)
+	{
+		switch (accelStructType)
+		{
+		case 0: Intersect<0>(ray, intersectionTests, traversalSteps); break;
+		case 1: Intersect<1>(ray, intersectionTests, traversalSteps); break;
+		case 2: Intersect<2>(ray, intersectionTests, traversalSteps); break;
+		case 3: Intersect<3>(ray, intersectionTests, traversalSteps); break;
+		case 4: Intersect<4>(ray, intersectionTests, traversalSteps); break;
+		case 5: Intersect<5>(ray, intersectionTests, traversalSteps); break;
+		default: Intersect<6>(ray, intersectionTests, traversalSteps); break;
+		}
+	}
+	float IntersectAABB(const Ray& ray, const float3 bmin, const float3 bmax) const
+	{
+		float tx1 = (bmin.x - ray.O.x) * ray.rD.x, tx2 = (bmax.x - ray.O.x) * ray.rD.x;
+		float tmin = min(tx1, tx2), tmax = max(tx1, tx2);
+		float ty1 = (bmin.y - ray.O.y) * ray.rD.y, ty2 = (bmax.y - ray.O.y) * ray.rD.y;
+		tmin = max(tmin, min(ty1, ty2)), tmax = min(tmax, max(ty1, ty2));
+		float tz1 = (bmin.z - ray.O.z) * ray.rD.z, tz2 = (bmax.z - ray.O.z) * ray.rD.z;
+		tmin = max(tmin, min(tz1, tz2)), tmax = min(tmax, max(tz1, tz2));
+		if (tmax >= tmin && tmin < ray.t && tmax > 0) return tmin;
+		else return 1e30f;
+	}
+	void Subdivide(uint nodeIdx)
+	{
+		// split the longest axis at the median instance centroid
+		Node& node = nodes[nodeIdx];
+		if (node.triCount <= 2) return;
+		float3 e = node.aabbMax - node.aabbMin;
+		int axis = 0;
+		if (e.y > e.x) axis = 1;
+		if (e.z > e[axis]) axis = 2;
+		uint* first = instIdx + node.leftFirst, leftCount = node.triCount / 2;
+		nth_element(first, first + leftCount, first + node.triCount, [&](uint a, uint b) {
+			return instances[a].aabbMin[axis] + instances[a].aabbMax[axis] < instances[b].aabbMin[axis] + instances[b].aabbMax[axis];
+		});
+		// create child nodes
+		int leftChildIdx = nodesUsed++;
+		int rightChildIdx = nodesUsed++;
+		nodes[leftChildIdx].leftFirst = node.leftFirst;
+		nodes[leftChildIdx].triCount = leftCount;
+		nodes[rightChildIdx].leftFirst = node.leftFirst + leftCount;
+		nodes[rightChildIdx].triCount = node.triCount - leftCount;
+		node.leftFirst = leftChildIdx;
+		node.triCount = 0;
+		UpdateNodeBounds(leftChildIdx);
+		UpdateNodeBounds(rightChildIdx);
+		// recurse
+		Subdivide(leftChildIdx);
+		Subdivide(rightChildIdx);
+	}
+	void UpdateNodeBounds(uint nodeIdx)
+	{
+		Node& node = nodes[nodeIdx];
+		node.aabbMin = float3(1e30f);
+		node.aabbMax = float3(-1e30f);
+		for (uint i = 0; i < node.triCount; i++)
+		{
+			const Instance& inst = instances[instIdx[node.leftFirst + i]];
+			node.aabbMin = fminf(node.aabbMin, inst.aabbMin);
+			node.aabbMax = fmaxf(node.aabbMax, inst.aabbMax);
+		}
+	}
+	vector<Instance> instances;
+	Node* nodes = 0;			// leaves use triCount for their instance count
+	uint* instIdx = 0;
+	uint instCount = 0, nodesUsed = 1;
+};
+
+}
@@ -79,7 +79,6 @@ using namespace std;
 #define NODEFERWINDOWPOS
 #define NOMCX
 #define NOIME
-#define MAX_TRIS 230000
 
 #include "windows.h"
 
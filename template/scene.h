@@ -1,8 +1,9 @@
 #pragma once
 #include "objects.h"
-#include "bvh.h"
-#include "kdtree.h"
-#include "octree.h"
+#include "tlas.h"
+#include "primbvh.h"
+
+#define SCENE_COUNT	5	// valid values of Scene::SceneIdx
 
 // -----------------------------------------------------------
 // scene.h
@@ -24,6 +25,19 @@
 
 namespace Tmpl8 {
 
+// -----------------------------------------------------------
+// Entry in the scene's object table. A hit carries the index
+// of its entry in ray.objIdx and, for meshes, the triangle in
+// ray.primIdx; shading finds the owner with one lookup, no
+// matter how many objects the scene holds.
+// -----------------------------------------------------------
+struct SceneObject
+{
+	enum { LIGHT = 0, PLANE, PRIM, MESH, MESH_INSTANCE };
+	int type;
+	int idx;			// PLANE: into Scene::plane; MESH_INSTANCE: into the TLAS instances
+};
+
 // -----------------------------------------------------------
 // Scene class
 // We intersect this. The query is internally forwarded to the
@@ -34,68 +48,74 @@ namespace Tmpl8 {
 	class Scene
 	{
 	public:
-		Scene()
+		Scene(int sceneIdx = 0) : SceneIdx(sceneIdx)
 		{
-			uint objIdx = 0;
 			// we store all primitives in one continuous buffer
-			for (int i = 0; i < 4; i++) lights[i] = Quad(objIdx, 5.0f);	// 0: four light sources
+			const int lightIdx = AddObject(SceneObject::LIGHT);
+			for (int i = 0; i < 4; i++) lights[i] = Quad(lightIdx, 5.0f);	// 0: four light sources
 
 			if (SceneIdx == 0) 
 			{
-				plane[0] = Plane(++objIdx, float3(1, 0, 0), 3);			// 4: left wall
-				plane[1] = Plane(++objIdx, float3(-1, 0, 0), 2.99f);		// 5: right wall
-				plane[2] = Plane(++objIdx, float3(0, 1, 0), 1);			// 6: floor
-				plane[3] = Plane(++objIdx, float3(0, -1, 0), 2);			// 7: ceiling
-				plane[4] = Plane(++objIdx, float3(0, 0, 1), 3);			// 8: front wall
-				plane[5] = Plane(++objIdx, float3(0, 0, -1), 3.99f);		// 9: back wall
-
-				int currIdx = objIdx;
-				bvh = BVH("../assets/teapot.obj", &objIdx, 1);
-				bvh.Build();
-				objIdx = currIdx;
-				kdtree = KDTree("../assets/teapot.obj",&objIdx, 1);
-				kdtree.Build();
-				objIdx = currIdx;
-				oct = Octree("../assets/teapot.obj", &objIdx, 1);
-				oct.Build();
+				plane[0] = Plane(AddObject(SceneObject::PLANE, 0), float3(1, 0, 0), 3);	// 1: left wall
+				plane[1] = Plane(AddObject(SceneObject::PLANE, 1), float3(-1, 0, 0), 2.99f);	// 2: right wall
+				plane[2] = Plane(AddObject(SceneObject::PLANE, 2), float3(0, 1, 0), 1);	// 3: floor
+				plane[3] = Plane(AddObject(SceneObject::PLANE, 3), float3(0, -1, 0), 2);	// 4: ceiling
+				plane[4] = Plane(AddObject(SceneObject::PLANE, 4), float3(0, 0, 1), 3);	// 5: front wall
+				plane[5] = Plane(AddObject(SceneObject::PLANE, 5), float3(0, 0, -1), 3.99f);	// 6: back wall
+				// objIdx of the wall that a ray hits on each axis, for a negative or positive direction
+				planeIdMin4 = _mm_castsi128_ps(_mm_setr_epi32(plane[0].objIdx, plane[2].objIdx, plane[4].objIdx, -1));
+				planeIdMax4 = _mm_castsi128_ps(_mm_setr_epi32(plane[1].objIdx, plane[3].objIdx, plane[5].objIdx, -1));
+
+				mesh = BLAS("../assets/teapot.obj", AddObject(SceneObject::MESH), 1);
+				mesh.Use(accelStructType);
 
 				//bvh.M = mat4::Translate(-0.25f, 0, 2) * mat4::RotateX(PI / 4);
 				//bvh.invM = bvh.M.Inverted();
 			}
 			else if (SceneIdx == 1)
 			{
-				int currIdx = objIdx;
-				bvh = BVH("../assets/teapot.obj", &objIdx, 1, float3(-.5, .2, .3));
-				bvh.Build();
-				objIdx = currIdx;
-				kdtree = KDTree("../assets/teapot.obj", &objIdx, 1, float3(-.5, .2, .3));
-				kdtree.Build();
-				objIdx = currIdx;
-				oct = Octree("../assets/teapot.obj", &objIdx, 1, float3(-.5, .2, .3));
-				oct.Build();
-
-				firstAccel2_objIdx = objIdx;
-
-				bvh2 = BVH("../assets/teapot.obj", &objIdx, 1, float3(.5, 0, -.1));
-				bvh2.Build();
-				objIdx = firstAccel2_objIdx;
-				kdtree2 = KDTree("../assets/teapot.obj", &objIdx, 1, float3(.5, 0, -.1));
-				kdtree2.Build();
-				objIdx = firstAccel2_objIdx;
-				oct = Octree("../assets/teapot.obj", &objIdx, 1, float3(.5, 0, -.1));
-				oct.Build();
+				// one teapot, placed twice; hits are reported per placement
+				mesh = BLAS("../assets/teapot.obj", -1, 1);
+				mesh.Use(accelStructType);
+				tlas.Add(&mesh, mat4::Translate(-.5f, .2f, .3f), AddObject(SceneObject::MESH_INSTANCE, 0));
+				tlas.Add(&mesh, mat4::Translate(.5f, 0, -.1f), AddObject(SceneObject::MESH_INSTANCE, 1));
+				tlas.Build();
 			}
 			else if (SceneIdx == 2)
 			{
-				int currIdx = objIdx;
-				bvh = BVH("../assets/dragon.obj", &objIdx, 1);
-				bvh.Build();
-				objIdx = currIdx;
-				kdtree = KDTree("../assets/dragon.obj", &objIdx, 1);
-				kdtree.Build();
-				objIdx = currIdx;
-				oct = Octree("../assets/dragon.obj", &objIdx, 1);
-				oct.Build();
+				mesh = BLAS("../assets/dragon.obj", AddObject(SceneObject::MESH), 1);
+				mesh.Use(accelStructType);
+			}
+			else if (SceneIdx == 3)
+			{
+				// the room, filled with a few hundred analytic primitives
+				prims.Add(Plane(AddObject(SceneObject::PRIM), float3(1, 0, 0), 3));
+				prims.Add(Plane(AddObject(SceneObject::PRIM), float3(-1, 0, 0), 2.99f));
+				prims.Add(Plane(AddObject(SceneObject::PRIM), float3(0, 1, 0), 1));
+				prims.Add(Plane(AddObject(SceneObject::PRIM), float3(0, -1, 0), 2));
+				prims.Add(Plane(AddObject(SceneObject::PRIM), float3(0, 0, 1), 3));
+				prims.Add(Plane(AddObject(SceneObject::PRIM), float3(0, 0, -1), 3.99f));
+				for (int y = 0; y < 3; y++) for (int z = 0; z < 12; z++) for (int x = 0; x < 12; x++)
+				{
+					float3 pos(-2.5f + x * 0.45f, -0.8f + y * 0.4f, -2.5f + z * 0.55f);
+					mat4 M = mat4::Translate(pos) * mat4::RotateY(x * 0.3f) * mat4::RotateX(z * 0.2f);
+					int type = (x + y + z) % 3;
+					if (type == 0) prims.Add(Sphere(AddObject(SceneObject::PRIM), pos, 0.1f));
+					else if (type == 1) prims.Add(Cube(AddObject(SceneObject::PRIM), float3(0), float3(0.16f), M));
+					else
+					{
+						Torus torus(AddObject(SceneObject::PRIM), 0.08f, 0.03f);
+						torus.T = M, torus.invT = M.FastInvertedTransformNoScale();
+						prims.Add(torus);
+					}
+				}
+				prims.Build();
+			}
+			else if (SceneIdx == 4)
+			{
+				// raw triangle list; converted to a binary .mesh on first load
+				mesh = BLAS("../assets/unity.tri", AddObject(SceneObject::MESH), 1, float3(1.48f, 0, 0));
+				mesh.Use(accelStructType);
 			}
 
 
@@ -121,47 +141,24 @@ namespace Tmpl8 {
 			// function is not valid when using four lights; we'll return the origin
 			return float3(0);
 		}
-		float3 RandomPointOnLight(const float r0, const float r1)
+		// light sampling with sample values from a Sampler, all in [0, 1)
+		uint GetRandomLight(const float r) const
 		{
-			// select a random light and use that
-			uint lightIdx = (uint)(r0 * 4);
-			const Quad& q = lights[lightIdx];
-			// renormalize r0 for reuse
-			float stratum = lightIdx * 0.25f;
-			float r2 = (r0 - stratum) / (1 - stratum);
-			// get a random position on the selected quad
-			const float size = q.size;
-			float3 corner1 = TransformPosition(float3(-size, 0, -size), q.T);
-			float3 corner2 = TransformPosition(float3(size, 0, -size), q.T);
-			float3 corner3 = TransformPosition(float3(-size, 0, size), q.T);
-			return corner1 + r2 * (corner2 - corner1) + r1 * (corner3 - corner1);
+			return min((uint)(r * 4), 3u);
 		}
-		uint GetRandomLight(uint& seed) 
+		float3 PointOnLightQuad(uint lightIdx, const float r0, const float r1) const
 		{
-			float r = RandomFloat();
-			uint lightIdx = (uint)(r * 4);
-			return lightIdx;
-		}
-		float3 RandomPointOnLightQuad(uint lightIdx, uint& seed) {
-			const float r0 = RandomFloat();
-			const float r1 = RandomFloat();
+			// r0 and r1 are independent of the light selection: use them as they are
 			const Quad& q = lights[lightIdx];
-			float stratum = lightIdx * 0.25f;
-			float r2 = (r0 - stratum) / (1 - stratum);
-			// get a random position on the selected quad
 			const float size = q.size;
 			float3 corner1 = TransformPosition(float3(-size, 0, -size), q.T);
 			float3 corner2 = TransformPosition(float3(size, 0, -size), q.T);
 			float3 corner3 = TransformPosition(float3(-size, 0, size), q.T);
-			return corner1 + r2 * (corner2 - corner1) + r1 * (corner3 - corner1);
+			return corner1 + r0 * (corner2 - corner1) + r1 * (corner3 - corner1);
 		}
 		Quad GetLightQuad(uint lightIdx) {
 			return lights[lightIdx];
 		}
-		float3 RandomPointOnLight(uint& seed)
-		{
-			return RandomPointOnLight(RandomFloat(seed), RandomFloat(seed));
-		}
 		void GetLightQuad(float3& v0, float3& v1, float3& v2, float3& v3, const uint idx = 0)
 		{
 
@@ -189,20 +186,21 @@ namespace Tmpl8 {
 		{
 			return 4; // what did you expect
 		}
-		void FindNearest(Ray& ray)
+		// Scene kernels: the scene layout (SCENE) and the mesh structure (TYPE, -1 for
+		// none) are template arguments, so the per-ray tests on SceneIdx, accelStruct and
+		// accelStructType fold away. Dispatch picks the kernel once per frame.
+		template <int SCENE, int TYPE> void FindNearest(Ray& ray)
 		{
 			// room walls - ugly shortcut for more speed
 			// 
 			// TODO: the room is actually just an AABB; use slab test
-			if (SceneIdx == 0) 
+			if constexpr (SCENE == 0)
 			{
 				static const __m128 x4min = _mm_setr_ps(3, 1, 3, 1e30f);
 				static const __m128 x4max = _mm_setr_ps(-2.99f, -2, -3.99f, 1e30f);
-				static const __m128 idmin = _mm_castsi128_ps(_mm_setr_epi32(4, 6, 8, -1));
-				static const __m128 idmax = _mm_castsi128_ps(_mm_setr_epi32(5, 7, 9, -1));
 				static const __m128 zero4 = _mm_setzero_ps();
 				const __m128 selmask = _mm_cmpge_ps(ray.D4, zero4);
-				const __m128i idx4 = _mm_castps_si128(_mm_blendv_ps(idmin, idmax, selmask));
+				const __m128i idx4 = _mm_castps_si128(_mm_blendv_ps(planeIdMin4, planeIdMax4, selmask));
 				const __m128 x4 = _mm_blendv_ps(x4min, x4max, selmask);
 				const __m128 d4 = _mm_sub_ps(zero4, _mm_mul_ps(_mm_add_ps(ray.O4, x4), ray.rD4));
 				const __m128 mask4 = _mm_cmple_ps(d4, zero4);
@@ -223,132 +221,120 @@ namespace Tmpl8 {
 				const __m128 maskedT = _mm_and_ps(t, _mm_and_ps(
 					_mm_and_ps(_mm_cmpgt_ps(Ix, nsize), _mm_cmplt_ps(Ix, size)),
 					_mm_and_ps(_mm_cmpgt_ps(Iz, nsize), _mm_cmplt_ps(Iz, size))));
-				if (maskedT.m128_f32[3] > 0) ray.t = maskedT.m128_f32[3], ray.objIdx = 0;
-				if (maskedT.m128_f32[2] > 0) ray.t = maskedT.m128_f32[2], ray.objIdx = 0;
-				if (maskedT.m128_f32[1] > 0) ray.t = maskedT.m128_f32[1], ray.objIdx = 0;
-				if (maskedT.m128_f32[0] > 0) ray.t = maskedT.m128_f32[0], ray.objIdx = 0;
+				if (maskedT.m128_f32[3] > 0) ray.t = maskedT.m128_f32[3], ray.objIdx = lights[0].objIdx;
+				if (maskedT.m128_f32[2] > 0) ray.t = maskedT.m128_f32[2], ray.objIdx = lights[0].objIdx;
+				if (maskedT.m128_f32[1] > 0) ray.t = maskedT.m128_f32[1], ray.objIdx = lights[0].objIdx;
+				if (maskedT.m128_f32[0] > 0) ray.t = maskedT.m128_f32[0], ray.objIdx = lights[0].objIdx;
 			}
 
 
 			
 
-			if (!accelStruct) return;
-			if (SceneIdx == 0 || SceneIdx == 2) 
-			{
-				if (accelStructType == 0) bvh.Intersect(ray, bvh.rootNodeIdx, &intersectionTests, &traversalSteps);
-				else if (accelStructType == 1) kdtree.Intersect(ray, kdtree.rootNodeIdx, &intersectionTests, &traversalSteps);
-				else if (accelStructType == 2) oct.Intersect(ray, oct.rootNodeIdx, &intersectionTests, &traversalSteps);
-			}
-			else if (SceneIdx == 1) 
+			if constexpr (SCENE == 3)
 			{
-				
-				if (accelStructType == 0)
-				{
-					bvh.Intersect(ray, bvh.rootNodeIdx, &intersectionTests, &traversalSteps); 
-					bvh2.Intersect(ray, bvh2.rootNodeIdx, &intersectionTests, &traversalSteps);
-				}
-				else if (accelStructType == 1)
-				{
-					kdtree.Intersect(ray, kdtree.rootNodeIdx, &intersectionTests, &traversalSteps); 
-					kdtree2.Intersect(ray, kdtree2.rootNodeIdx, &intersectionTests, &traversalSteps);
-				}
-				else if (accelStructType == 2) {
-					oct.Intersect(ray, oct.rootNodeIdx, &intersectionTests, &traversalSteps); 
-					oct2.Intersect(ray, oct2.rootNodeIdx, &intersectionTests, &traversalSteps);
-				}
+				for (int i = 0; i < 4; i++) lights[i].Intersect(ray);
+				if constexpr (TYPE >= 0) prims.Intersect(ray, &intersectionTests, &traversalSteps);
+				else prims.IntersectAll(ray, &intersectionTests);
 			}
-
-
+			// without a structure, meshes aren't traced
+			else if constexpr (TYPE < 0) return;
+			else if constexpr (SCENE == 1) tlas.Intersect<TYPE>(ray, &intersectionTests, &traversalSteps);
+			else mesh.Intersect<TYPE>(ray, &intersectionTests, &traversalSteps);
 		}
-		bool IsOccluded(const Ray& ray) const
+		template <int SCENE, int TYPE> bool IsOccluded(const Ray& ray)
 		{
 			for (int i = 0; i < 4; i++) if (lights[i].IsOccluded(ray)) return true;
-			return false; // skip planes and rounded corners
+			// skip planes and rounded corners
+			if constexpr (SCENE == 3) return prims.IsOccluded(ray);
+			else if constexpr (TYPE < 0) return false;
+			else
+			{
+				// the mesh kernels find the nearest hit: anything before ray.t occludes
+				Ray shadow = ray;
+				if constexpr (SCENE == 1) tlas.Intersect<TYPE>(shadow, &intersectionTests, &traversalSteps);
+				else mesh.Intersect<TYPE>(shadow, &intersectionTests, &traversalSteps);
+				return shadow.t < ray.t;
+			}
 		}
-		float3 GetNormal(const int objIdx, const float3 I, const float3 wo) const
+		template <int SCENE, int TYPE> float3 GetNormal(const Ray& ray, const float3 I) const
 		{
 			// we get the normal after finding the nearest intersection:
 			// this way we prevent calculating it multiple times.
-			if (objIdx == -1) return float3(0); // or perhaps we should just crash
+			if (ray.objIdx == -1) return float3(0); // or perhaps we should just crash
+			const SceneObject& obj = objects[ray.objIdx];
 			float3 N = 0;
-			if (objIdx == 0) N = lights[0].GetNormal(I); // they're all oriented the same
-
-			if (SceneIdx == 0) {
-				if (objIdx >= 4 && objIdx <= 9) {
-					// faster to handle the 6 planes without a call to GetNormal
-					N = float3(0);
-					N[(objIdx - 4) / 2] = 1 - 2 * (float)(objIdx & 1);
-				}
-				else if (accelStruct)
-				{
-					if (accelStructType == 0) N = bvh.GetNormal(objIdx);
-					else if (accelStructType == 1) N = kdtree.GetNormal(objIdx);
-					else N = oct.GetNormal(objIdx);
-				}
-			}
-			else if (SceneIdx == 1) {
-				if (!accelStruct) return N;
-				if (objIdx < firstAccel2_objIdx) {
-					if (accelStructType == 0) N = bvh.GetNormal(objIdx);
-					else if (accelStructType == 1) N = kdtree.GetNormal(objIdx);
-					else N = oct.GetNormal(objIdx);
-				}
-				else {
-					if (accelStructType == 0) N = bvh2.GetNormal(objIdx);
-					else if (accelStructType == 1) N = kdtree2.GetNormal(objIdx);
-					else N = oct2.GetNormal(objIdx);
-				}
-			}
-			else if (SceneIdx == 2) {
-				if (accelStruct)
-				{
-					if (accelStructType == 0) N = bvh.GetNormal(objIdx);
-					else if (accelStructType == 1) N = kdtree.GetNormal(objIdx);
-					else N = oct.GetNormal(objIdx);
-				}
+			switch (obj.type)
+			{
+			case SceneObject::LIGHT: N = lights[0].GetNormal(I); break; // they're all oriented the same
+			case SceneObject::PLANE: N[obj.idx / 2] = 1 - 2 * (float)(obj.idx & 1); break; // axis aligned: no call to GetNormal
+			case SceneObject::PRIM: N = prims.GetNormal(ray.objIdx, I); break;
+			// meshes are only hit when they are traced: TYPE >= 0
+			case SceneObject::MESH: if constexpr (TYPE >= 0) N = mesh.GetNormal<TYPE>(ray.primIdx, ray.u, ray.v); break;
+			// instanced meshes return their normal in world space
+			case SceneObject::MESH_INSTANCE: if constexpr (TYPE >= 0) N = tlas.GetNormal<TYPE>(obj.idx, ray.primIdx, ray.u, ray.v); break;
 			}
-			
-			if (dot(N, wo) > 0) N = -N; // hit backside / inside
+			if (dot(N, ray.D) > 0) N = -N; // hit backside / inside
 			return N;
 		}
-		float3 GetAlbedo(int objIdx, float3 I) const
+		template <int SCENE, int TYPE> float3 GetAlbedo(const Ray& ray, float3 I) const
 		{
-			if (objIdx == -1) return float3(0); // or perhaps we should just crash
-			if (objIdx == 0) return lights[0].GetAlbedo(I); // they're all the same
-
-			if (SceneIdx == 0) {
-				if (objIdx >= 4 && objIdx <= 9) return plane[objIdx - 4].GetAlbedo(I);
-				if (!accelStruct) return 0;
-
-				if (accelStructType == 0) return bvh.GetAlbedo();
-				else if (accelStructType == 1) return kdtree.GetAlbedo();
-				else return oct.GetAlbedo();
+			if (ray.objIdx == -1) return float3(0); // or perhaps we should just crash
+			const SceneObject& obj = objects[ray.objIdx];
+			switch (obj.type)
+			{
+			case SceneObject::LIGHT: return lights[0].GetAlbedo(I); // they're all the same
+			case SceneObject::PLANE: return plane[obj.idx].GetAlbedo(I);
+			case SceneObject::PRIM: return prims.GetAlbedo(ray.objIdx, I);
+			default:
+				if constexpr (TYPE >= 0) return mesh.GetAlbedo<TYPE>(); // also shared by the instances
+				else return float3(0);
 			}
-			else if (SceneIdx == 1) {
-				if (!accelStruct) return 0;
-
-				if (objIdx < firstAccel2_objIdx) {
-					if (accelStructType == 0) return bvh.GetAlbedo();
-					else if (accelStructType == 1) return kdtree.GetAlbedo();
-					else return oct.GetAlbedo();
-				}
-				else {
-					if (accelStructType == 0) return bvh2.GetAlbedo();
-					else if (accelStructType == 1) return kdtree2.GetAlbedo();
-					else return oct2.GetAlbedo();
-				}
-				
+		}
+		// calls f(scene, type) with SceneIdx and the mesh structure in use as compile-time
+		// constants (integral_constant), so f can run the matching kernels
+		template <class F> void Dispatch(F f) const
+		{
+			switch (SceneIdx)
+			{
+			case 0: DispatchType<0>(f); break;
+			case 1: DispatchType<1>(f); break;
+			case 2: DispatchType<2>(f); break;
+			case 3: DispatchType<3>(f); break;
+			default: DispatchType<4>(f); break;
 			}
-			else if (SceneIdx == 2) {
-				if (accelStructType == 0) return bvh.GetAlbedo();
-				else if (accelStructType == 1) return kdtree.GetAlbedo();
-				else return oct.GetAlbedo();
+		}
+		template <int SCENE, class F> void DispatchType(F f) const
+		{
+			typedef integral_constant<int, SCENE> S;
+			if (!accelStruct) { f(S(), integral_constant<int, -1>()); return; }
+			// the analytic scene has no mesh: its BVH doesn't depend on accelStructType
+			if constexpr (SCENE == 3) f(S(), integral_constant<int, 0>());
+			else switch (mesh.Type(accelStructType))
+			{
+			case 0: f(S(), integral_constant<int, 0>()); break;
+			case 1: f(S(), integral_constant<int, 1>()); break;
+			case 2: f(S(), integral_constant<int, 2>()); break;
+			case 3: f(S(), integral_constant<int, 3>()); break;
+			case 4: f(S(), integral_constant<int, 4>()); break;
+			case 5: f(S(), integral_constant<int, 5>()); break;
+			default: f(S(), integral_constant<int, 6>()); break;
 			}
-			return 0;
+		}
+		// switch the mesh structure; builds or loads it and releases the previous one
+		void SetAccelStructType(int type)
+		{
+			accelStructType = type;
+			mesh.Use(type);
+		}
+		// new entry in the object table; returns its objIdx
+		int AddObject(int type, int idx = 0)
+		{
+			objects.push_back({ type, idx });
+			return (int)objects.size() - 1;
 		}
 
 		float3 GetCameraPos(int posIdx) {
-			if (SceneIdx == 0 || SceneIdx == 2)
+			if (SceneIdx != 1)
 			{
 				if (posIdx == 0) return float3(0, 0, -2);
 				else if (posIdx == 1) return float3(1, 0, -2);
@@ -363,7 +349,7 @@ namespace Tmpl8 {
 		}
 
 		float3 GetCameraTarget(int posIdx) {
-			if (SceneIdx == 0 || SceneIdx == 2)
+			if (SceneIdx != 1)
 			{
 				if (posIdx == 0) return float3(0, 0, -1);
 				else if (posIdx == 1) return float3(0, 0, -1);
@@ -382,17 +368,14 @@ namespace Tmpl8 {
 
 		Quad lights[4];
 		Plane plane[6];
+		__m128 planeIdMin4, planeIdMax4;	// SceneIdx 0: objIdx of plane[0, 2, 4] and plane[1, 3, 5]
 
 		bool accelStruct = true;
-		int accelStructType = 0;
-		BVH bvh;
-		KDTree kdtree;
-		Octree oct;
-
-		int firstAccel2_objIdx = -1;
-		BVH bvh2;
-		KDTree kdtree2;
-		Octree oct2;
+		int accelStructType = 0;		// one of the BLAS types, or BLAS_AUTO
+		BLAS mesh;
+		TLAS tlas;		// SceneIdx 1: instances of mesh
+		PrimitiveBVH prims;	// SceneIdx 3: analytic primitives
+		vector<SceneObject> objects;	// indexed by ray.objIdx
 
 
 		int SceneIdx = 0;
@@ -79,9 +79,55 @@ void ErrorCallback( int, const char* description )
 	fprintf( stderr, "GLFW Error: %s\n", description );
 }
 
+// The linker makes this a windowed app: the offline tools print to the console
+// they were started from, or to a new one
+void OpenConsole()
+{
+	if (!AttachConsole( ATTACH_PARENT_PROCESS )) AllocConsole();
+	FILE* file = nullptr;
+	freopen_s( &file, "CONOUT$", "w", stdout );
+	freopen_s( &file, "CONOUT$", "w", stderr );
+}
+
+// Build and store every structure of one asset; reports and returns the result
+bool Bake( BLAS& blas )
+{
+	const bool ok = blas.Build();
+	printf( "Bake: %s %s\n", blas.asset.c_str(), ok ? "ok" : "FAILED" );
+	return ok;
+}
+
 // Application entry point
-void main()
+int main( int argc, char** argv )
 {
+	// offline: "--bake" constructs every scene once, so the acceleration structure caches
+	// of all assets exist before the first interactive run; "--bake <files>" bakes just those.
+	// The exit code is the number of assets that failed to load, build or store
+	if (argc > 1 && !strcmp( argv[1], "--bake" ))
+	{
+		OpenConsole();
+		int failed = 0;
+		if (argc == 2) for (int i = 0; i < SCENE_COUNT; i++)
+		{
+			// a scene only keeps the structure in use; bake the others too
+			Scene scene( i );
+			if (!scene.mesh.asset.empty()) failed += !Bake( scene.mesh );
+		}
+		else for (int i = 2; i < argc; i++)
+		{
+			BLAS blas( argv[i], 0 );
+			failed += !Bake( blas );
+		}
+		return failed;
+	}
+	// offline: "--convert <src> <dst>" writes a text mesh in the binary .mesh format
+	if (argc == 4 && !strcmp( argv[1], "--convert" ))
+	{
+		OpenConsole();
+		const bool ok = Mesh::Convert( argv[2], argv[3] );
+		printf( "Convert: %s -> %s %s\n", argv[2], argv[3], ok ? "ok" : "FAILED" );
+		return ok ? 0 : 1;
+	}
 	// open a window
 	if (!glfwInit()) FatalError( "glfwInit failed." );
 	glfwSetErrorCallback( ErrorCallback );